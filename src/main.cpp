@@ -8,6 +8,20 @@
 #include <sys/stat.h>
 #include <fstream>
 #include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <string_view>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdio>
+#include <climits>
+
+#ifdef __SSE2__
+#include <emmintrin.h> // For vectorized completion matching
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
@@ -21,17 +35,184 @@
 #include <cstring>
 #include <termios.h> // Only included for Unix systems
 #include <dirent.h>  // For directory operations on Unix
+#include <poll.h>    // For multiplexing redirection relays
+#include <signal.h>
+#include <sys/ioctl.h> // For FIONREAD on pipes
+#include <sys/syscall.h> // For pidfd_open and pidfd_send_signal
+#include <sys/timerfd.h>
+#include <sys/mman.h> // For mapping the rc cache
+#include <sys/resource.h> // For ulimit and per-command limits
+#include <sys/xattr.h>    // For systemd's cgroup delegation marker
+#include <spawn.h>        // For running git from the prompt worker
+#include <ctime>
+
+extern char **environ;
+#endif
+
+#if !defined(_WIN32) && !defined(__linux__)
+#error "The Unix build needs Linux (splice, tee, pipe2, timerfd, pidfd); see README.md"
 #endif
 
 using namespace std;
 
-// Structure to hold redirection information
-struct RedirectInfo
+// A single redirection target; one fd may have several of them (multios)
+struct RedirectTarget
 {
   string filename;
   bool append;
+  unsigned long long bytes_written;
+};
+
+// Structure to hold redirection information
+struct RedirectInfo
+{
+  vector<RedirectTarget> targets;
+};
+
+// Deadline enforced by the timeout builtin: SIGTERM when it expires, then
+// SIGKILL once kill_after more seconds have passed. The deadline is absolute,
+// so every command run under one timeout (e.g. each retry attempt) shares it.
+struct JobTimeout
+{
+  bool enabled = false;
+  chrono::steady_clock::time_point deadline;
+  double kill_after = 5;
+
+  double remaining() const
+  {
+    chrono::duration<double> left = deadline - chrono::steady_clock::now();
+    return left.count() > 0 ? left.count() : 0;
+  }
+};
+
+// Resource usage of a finished job, collected when its children are reaped
+struct JobUsage
+{
+  long peak_rss_kb = 0;
+  double cpu_seconds = 0;
+};
+
+// Per-command controls set up by the wrapper builtins (timeout, limit)
+struct JobControls
+{
+  JobTimeout timeout; // No deadline unless enabled
+  string cgroup;      // cgroup v2 directory the children join, if any
+#ifndef _WIN32
+  vector<pair<int, rlimit>> rlimits; // Applied in the child on top of ulimit
+#endif
+  JobUsage *usage = nullptr; // Filled in once the job has been reaped
+};
+
+// One stage of a pipeline
+struct Command
+{
+  vector<string> args;
+  RedirectInfo stdout_info;
+  RedirectInfo stderr_info;
+};
+
+// Throughput counters of the relay between two pipeline stages
+struct PipeLinkStats
+{
+  unsigned long long bytes = 0;
+  size_t capacity = 0;
+  unsigned long samples = 0;
+  double upstream_fill = 0;     // Sum of sampled fill ratios of the producer's pipe
+  double downstream_fill = 0;   // Sum of sampled fill ratios of the consumer's pipe
+  unsigned long producer_waits = 0;
+  unsigned long consumer_waits = 0;
+  double producer_wait_seconds = 0; // Relay idle because the producer had nothing
+  double consumer_wait_seconds = 0; // Relay idle because the consumer's pipe was full
+};
+
+// Result of a monitored pipeline, reported by the pstat builtin
+struct PipelineStats
+{
+  vector<string> stages;
+  vector<PipeLinkStats> links;
+  double seconds = 0;
+};
+
+// State shared by every command line the shell runs, typed or from the rc file
+struct ShellState
+{
+  unordered_set<string> builtins = {"echo", "type", "exit", "pwd", "cd", "redirstat", "pstat", "timeout", "retry",
+                                    "compmode", "alias", "unalias", "export", "ulimit", "limit"};
+
+  // Opt-in splice relays between pipeline stages (pstat on)
+  bool pipeline_monitoring = false;
+  PipelineStats last_pipeline_stats;
+
+  // Byte counters of the most recent command that redirected its output
+  RedirectInfo last_stdout_info;
+  RedirectInfo last_stderr_info;
+
+  map<string, string> aliases;
+  map<string, string> variables; // Shell variables; exported ones live in the environment
+  map<string, vector<string>> functions;
+  vector<string> positional;     // $1, $2, ... while a function runs
+  int function_depth = 0;
+
+#ifndef _WIN32
+  map<int, rlimit> child_rlimits; // Set by ulimit, applied to every child
+#endif
+
+  int last_status = 0;    // $?
+  vector<int> pipestatus; // Status of every stage of the last pipeline
+
+  bool exit_requested = false;
+  int exit_code = 0;
 };
 
+ShellState shell;
+
+// Value of $name: special parameters, positional parameters, shell
+// variables, then the environment
+string lookup_variable(const string &name)
+{
+  if (name == "?")
+    return to_string(shell.last_status);
+  // PIPESTATUS is stage 0, PIPESTATUS[n] stage n, PIPESTATUS[@] all of them
+  if (name.rfind("PIPESTATUS", 0) == 0 && (name.size() == 10 || name[10] == '['))
+  {
+    string index = name.size() > 10 ? name.substr(11, name.size() - 12) : "0";
+    if (index == "@" || index == "*")
+    {
+      string joined;
+      for (size_t i = 0; i < shell.pipestatus.size(); ++i)
+        joined += (i ? " " : "") + to_string(shell.pipestatus[i]);
+      return joined;
+    }
+    if (index.empty() || index.size() > 9 || index.find_first_not_of("0123456789") != string::npos)
+      return "";
+    size_t stage = stoul(index);
+    return stage < shell.pipestatus.size() ? to_string(shell.pipestatus[stage]) : "";
+  }
+  if (name == "#")
+    return to_string(shell.positional.size());
+  if (name == "@")
+  {
+    string joined;
+    for (size_t i = 0; i < shell.positional.size(); ++i)
+      joined += (i ? " " : "") + shell.positional[i];
+    return joined;
+  }
+  if (!name.empty() && isdigit((unsigned char)name[0]))
+  {
+    // Longer numbers are out of range for any argument list (and for stoul)
+    if (name.size() > 9 || name.find_first_not_of("0123456789") != string::npos)
+      return "";
+    size_t index = stoul(name);
+    return index >= 1 && index <= shell.positional.size() ? shell.positional[index - 1] : "";
+  }
+
+  auto variable = shell.variables.find(name);
+  if (variable != shell.variables.end())
+    return variable->second;
+  const char *value = getenv(name.c_str());
+  return value ? value : "";
+}
+
 #ifndef _WIN32
 bool is_executable(const string &path)
 {
@@ -66,804 +247,3941 @@ string find_in_path(const string &cmd)
   return "";
 }
 
-void execute_external_command(const vector<string> &args, const RedirectInfo &stdout_info, const RedirectInfo &stderr_info)
+long long modification_time(const struct stat &buffer)
 {
-  if (args.empty())
-    return;
-
-  string cmd_path = find_in_path(args[0]);
-  if (cmd_path.empty())
-  {
-    cerr << args[0] << ": command not found" << endl;
-    return;
-  }
-
 #ifdef _WIN32
-  // Windows: Use CreateProcess with output redirection
-  string command = cmd_path;
-  for (size_t i = 1; i < args.size(); ++i)
-  {
-    command += " " + args[i];
-  }
-
-  SECURITY_ATTRIBUTES sa;
-  sa.nLength = sizeof(SECURITY_ATTRIBUTES);
-  sa.lpSecurityDescriptor = NULL;
-  sa.bInheritHandle = TRUE; // Allow child to inherit handle
+  return (long long)buffer.st_mtime * 1000000000LL;
+#else
+  return (long long)buffer.st_mtim.tv_sec * 1000000000LL + buffer.st_mtim.tv_nsec;
+#endif
+}
 
-  HANDLE hFile = NULL;
-  if (!stdout_info.filename.empty())
-  {
-    DWORD dwCreationDisposition = stdout_info.append ? OPEN_ALWAYS : CREATE_ALWAYS;
-    hFile = CreateFileA(stdout_info.filename.c_str(), GENERIC_WRITE, FILE_SHARE_WRITE, &sa,
-                        dwCreationDisposition, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (hFile == INVALID_HANDLE_VALUE)
-    {
-      cerr << "Failed to open file: " << stdout_info.filename << endl;
-      return;
-    }
+#ifndef _WIN32
+// The terminal stays in raw mode across prompts and is only switched back to
+// the mode it started in while a child process owns it
+struct TerminalSession
+{
+  bool interactive = false; // stdin is a terminal
+  bool raw = false;
+  pid_t owner = 0;          // Children inherit this struct but must not restore
+  termios cooked;
+  string pending;           // Bytes read but not consumed by the line editor yet
+  bool eof = false;
+  bool prompt_changed = false; // A prompt worker delivered fresher segments
+};
 
-    // If appending, seek to end of file
-    if (stdout_info.append)
-    {
-      SetFilePointer(hFile, 0, NULL, FILE_END);
-    }
-  }
+TerminalSession terminal;
 
-  HANDLE hErrorFile = NULL;
-  if (!stderr_info.filename.empty())
-  {
-    DWORD dwCreationDisposition = stderr_info.append ? OPEN_ALWAYS : CREATE_ALWAYS;
-    hErrorFile = CreateFileA(stderr_info.filename.c_str(), GENERIC_WRITE, FILE_SHARE_WRITE, &sa,
-                             dwCreationDisposition, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (hErrorFile == INVALID_HANDLE_VALUE)
-    {
-      cerr << "Failed to open file: " << stderr_info.filename << endl;
-      if (hFile)
-        CloseHandle(hFile);
-      return;
-    }
+// Git segment of the prompt for one repository. The branch is read straight
+// from HEAD; the dirty state needs a `git status` and comes from the worker.
+struct GitSegment
+{
+  long long index_mtime = -1;  // Cache key: .git/index modification time
+  unsigned long generation = 0; // and the command count when it was computed
+  int dirty = -1;               // -1 while unknown
+};
 
-    // If appending, seek to end of file
-    if (stderr_info.append)
-    {
-      SetFilePointer(hErrorFile, 0, NULL, FILE_END);
-    }
-  }
+// Prompt state shared with the background worker that computes expensive
+// segments. The input thread renders from whatever is cached, schedules a
+// refresh when the key changed, and is woken through wake_fds on completion.
+struct PromptState
+{
+  int last_status = 0;
+  double last_duration = 0;
+  unsigned long generation = 0; // Bumped after each command, which may touch the worktree
 
-  STARTUPINFOA si = {sizeof(si)};
-  PROCESS_INFORMATION pi;
-  si.dwFlags = STARTF_USESTDHANDLES;
-  si.hStdOutput = hFile ? hFile : GetStdHandle(STD_OUTPUT_HANDLE);
-  si.hStdError = hErrorFile ? hErrorFile : GetStdHandle(STD_ERROR_HANDLE);
-  si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+  mutex lock;
+  condition_variable wanted;
+  map<string, GitSegment> git; // Keyed on the git directory
+  bool worker_started = false;
+  bool job_pending = false;
+  string job_root;
+  string job_git_dir;
+  GitSegment job_key;
+  string job_git;         // Resolved on the main thread, like the environment
+  vector<string> job_env; // Snapshot of environ; export may change it meanwhile
+  int wake_fds[2] = {-1, -1};
+};
 
-  if (CreateProcessA(NULL, const_cast<char *>(command.c_str()), NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
-  {
-    WaitForSingleObject(pi.hProcess, INFINITE);
-    CloseHandle(pi.hProcess);
-    CloseHandle(pi.hThread);
-  }
-  else
-  {
-    cerr << "Failed to execute: " << command << endl;
-  }
+// Never destroyed: the detached worker may still be waiting on it at exit
+PromptState &prompt = *new PromptState;
 
-  if (hFile)
-    CloseHandle(hFile);
-  if (hErrorFile)
-    CloseHandle(hErrorFile);
-#else
-  // Linux/Mac: Use fork + execvp with output redirection
-  vector<char *> c_args;
-  for (const string &arg : args)
-  {
-    c_args.push_back(const_cast<char *>(arg.c_str()));
-  }
-  c_args.push_back(nullptr);
+long long file_mtime(const string &path)
+{
+  struct stat buffer;
+  if (stat(path.c_str(), &buffer) != 0)
+    return -1;
+  return modification_time(buffer);
+}
 
-  pid_t pid = fork();
-  if (pid == 0) // Child process
+// Walk up from dir looking for a .git directory (or a gitdir: file, as used
+// by worktrees and submodules)
+bool find_git_dir(string dir, string &root, string &git_dir)
+{
+  while (!dir.empty())
   {
-    if (!stdout_info.filename.empty())
-    {
-      int flags = O_WRONLY | O_CREAT;
-      flags |= stdout_info.append ? O_APPEND : O_TRUNC;
-      int fd = open(stdout_info.filename.c_str(), flags, 0644);
-      if (fd == -1)
-      {
-        perror("open output file failed");
-        exit(1);
-      }
-      dup2(fd, STDOUT_FILENO); // Redirect stdout
-      close(fd);
-    }
-
-    if (!stderr_info.filename.empty())
+    string candidate = dir + (dir == "/" ? "" : "/") + ".git";
+    struct stat buffer;
+    if (stat(candidate.c_str(), &buffer) == 0)
     {
-      int flags = O_WRONLY | O_CREAT;
-      flags |= stderr_info.append ? O_APPEND : O_TRUNC;
-      int fd = open(stderr_info.filename.c_str(), flags, 0644);
-      if (fd == -1)
+      root = dir;
+      git_dir = candidate;
+      if (S_ISREG(buffer.st_mode))
       {
-        perror("open error file failed");
-        exit(1);
+        ifstream file(candidate);
+        string line;
+        getline(file, line);
+        if (line.rfind("gitdir: ", 0) != 0)
+          return false;
+        git_dir = line.substr(8);
+        if (git_dir[0] != '/')
+          git_dir = dir + "/" + git_dir;
       }
-      dup2(fd, STDERR_FILENO); // Redirect stderr
-      close(fd);
+      return true;
     }
-
-    execvp(cmd_path.c_str(), c_args.data());
-    perror("execvp failed");
-    exit(1);
-  }
-  else if (pid > 0) // Parent process
-  {
-    int status;
-    waitpid(pid, &status, 0);
-  }
-  else
-  {
-    perror("fork failed");
+    if (dir == "/")
+      break;
+    size_t slash = dir.find_last_of('/');
+    dir = slash == 0 ? "/" : dir.substr(0, slash);
   }
-#endif
+  return false;
 }
 
-vector<string> parse_input(const string &input, RedirectInfo &stdout_info, RedirectInfo &stderr_info)
+string read_git_branch(const string &git_dir)
 {
-  vector<string> args;
-  string word;
-  bool in_single_quotes = false;
-  bool in_double_quotes = false;
-  bool escaped = false;
+  ifstream head(git_dir + "/HEAD");
+  string line;
+  getline(head, line);
+  if (line.rfind("ref: refs/heads/", 0) == 0)
+    return line.substr(16);
+  return line.substr(0, 7); // Detached HEAD
+}
 
-  for (size_t i = 0; i < input.size(); ++i)
+void prompt_worker()
+{
+  unique_lock<mutex> guard(prompt.lock);
+  while (true)
   {
-    char c = input[i];
-
-    if (escaped)
-    {
-      if (in_double_quotes && (c != '\\' && c != '$' && c != '"' && c != '\n'))
-        word += '\\';
-      word += c;
-      escaped = false;
-    }
-    else if (c == '\\' && !in_single_quotes)
-    {
-      escaped = true;
-    }
-    else if (c == '"' && !in_single_quotes)
-    {
-      in_double_quotes = !in_double_quotes;
-    }
-    else if (c == '\'' && !in_double_quotes)
-    {
-      in_single_quotes = !in_single_quotes;
-    }
-    else if ((!in_single_quotes && !in_double_quotes) &&
-             ((c == '>' && i + 1 < input.size() && input[i + 1] == '>') ||                                                // >>
-              (c == '1' && i + 1 < input.size() && input[i + 1] == '>' && i + 2 < input.size() && input[i + 2] == '>') || // 1>>
-              (c == '2' && i + 1 < input.size() && input[i + 1] == '>' && i + 2 < input.size() && input[i + 2] == '>')))  // 2>>
-    {
-      // Handle >> operators (append mode)
-      if (!word.empty())
-      {
-        args.push_back(word);
-        word.clear();
-      }
-
-      bool is_stderr = (c == '2');
+    prompt.wanted.wait(guard, []
+                       { return prompt.job_pending; });
+    string root = prompt.job_root;
+    string git_dir = prompt.job_git_dir;
+    GitSegment segment = prompt.job_key;
+    string git = prompt.job_git;
+    vector<string> env = prompt.job_env;
+    guard.unlock();
 
-      // Skip the operator (>> or 1>> or 2>>)
-      if (c == '>')
-        i++;
-      else
-        i += 2;
+    // The main thread may setenv() at any time, so git gets the snapshot as
+    // an explicit envp and nothing here reads environ. --no-optional-locks
+    // keeps git from rewriting the index, which would change the cache key
+    // and trigger another refresh.
+    vector<string> argv_text = {"git", "-C", root, "--no-optional-locks", "status", "--porcelain",
+                                "--untracked-files=no"};
+    vector<char *> argv, envp;
+    for (string &arg : argv_text)
+      argv.push_back(arg.data());
+    argv.push_back(nullptr);
+    for (string &entry : env)
+      envp.push_back(entry.data());
+    envp.push_back(nullptr);
 
-      // Skip spaces before the filename
-      while (i + 1 < input.size() && input[i + 1] == ' ')
-        i++;
+    int fds[2];
+    if (!git.empty() && pipe2(fds, O_CLOEXEC) == 0)
+    {
+      posix_spawn_file_actions_t actions;
+      posix_spawn_file_actions_init(&actions);
+      posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+      posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+      posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
 
-      size_t j = i + 1;
-      while (j < input.size() && input[j] != ' ' &&
-             !(input[j] == '>' ||
-               (input[j] == '1' && j + 1 < input.size() && input[j + 1] == '>') ||
-               (input[j] == '2' && j + 1 < input.size() && input[j + 1] == '>')))
-        j++;
+      pid_t pid;
+      bool spawned = posix_spawn(&pid, git.c_str(), &actions, nullptr, argv.data(), envp.data()) == 0;
+      posix_spawn_file_actions_destroy(&actions);
+      close(fds[1]);
 
-      if (i + 1 < input.size())
+      if (spawned)
       {
-        string filename = input.substr(i + 1, j - i - 1);
-        if (is_stderr)
-        {
-          stderr_info.filename = filename;
-          stderr_info.append = true;
-        }
-        else
-        {
-          stdout_info.filename = filename;
-          stdout_info.append = true;
-        }
+        char buffer[256];
+        ssize_t n;
+        bool output = false;
+        while ((n = read(fds[0], buffer, sizeof(buffer))) > 0 || (n == -1 && errno == EINTR))
+          output = output || n > 0;
+        int status = 0;
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+          ;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+          segment.dirty = output;
       }
-
-      i = j - 1;
+      close(fds[0]);
     }
-    else if ((!in_single_quotes && !in_double_quotes) &&
-             ((c == '>') ||
-              (c == '1' && i + 1 < input.size() && input[i + 1] == '>') ||
-              (c == '2' && i + 1 < input.size() && input[i + 1] == '>')))
+
+    guard.lock();
+    prompt.git[git_dir] = segment;
+    if (prompt.job_git_dir == git_dir && prompt.job_key.index_mtime == segment.index_mtime &&
+        prompt.job_key.generation == segment.generation)
+      prompt.job_pending = false;
+
+    char wake = 1;
+    if (write(prompt.wake_fds[1], &wake, 1) == -1)
     {
-      // Handle > operators (truncate mode)
-      if (!word.empty())
-      {
-        args.push_back(word);
-        word.clear();
-      }
+      // The pipe is full, so a wakeup is already pending
+    }
+  }
+}
 
-      bool is_stderr = (c == '2' && i + 1 < input.size() && input[i + 1] == '>');
+// Render the prompt from cached segments, scheduling a background refresh of
+// anything stale. Non-interactive sessions keep the plain "$ " prompt.
+string render_prompt()
+{
+  if (!terminal.interactive)
+    return "$ ";
 
-      // Skip the operator (> or 1> or 2>)
-      if (c != '>')
-        i++;
+  char cwd[PATH_MAX];
+  string dir = getcwd(cwd, sizeof(cwd)) ? cwd : "";
+  string text = dir;
+  const char *home = getenv("HOME");
+  if (home && *home && text.rfind(home, 0) == 0 && (text.size() == strlen(home) || text[strlen(home)] == '/'))
+    text = "~" + text.substr(strlen(home));
 
-      // Skip spaces before the filename
-      while (i + 1 < input.size() && input[i + 1] == ' ')
-        i++;
+  string root, git_dir;
+  if (find_git_dir(dir, root, git_dir))
+  {
+    GitSegment key;
+    key.index_mtime = file_mtime(git_dir + "/index");
+    key.generation = prompt.generation;
 
-      size_t j = i + 1;
-      while (j < input.size() && input[j] != ' ' &&
-             !(input[j] == '>' ||
-               (input[j] == '1' && j + 1 < input.size() && input[j + 1] == '>') ||
-               (input[j] == '2' && j + 1 < input.size() && input[j + 1] == '>')))
-        j++;
+    lock_guard<mutex> guard(prompt.lock);
+    auto cached = prompt.git.find(git_dir);
+    int dirty = cached == prompt.git.end() ? -1 : cached->second.dirty;
+    bool fresh = cached != prompt.git.end() && cached->second.index_mtime == key.index_mtime &&
+                 cached->second.generation == key.generation;
 
-      if (i + 1 < input.size())
+    if (!fresh && !(prompt.job_pending && prompt.job_git_dir == git_dir &&
+                    prompt.job_key.index_mtime == key.index_mtime && prompt.job_key.generation == key.generation))
+    {
+      if (!prompt.worker_started)
       {
-        string filename = input.substr(i + 1, j - i - 1);
-        if (is_stderr)
-        {
-          stderr_info.filename = filename;
-          stderr_info.append = false;
-        }
-        else
+        if (pipe2(prompt.wake_fds, O_CLOEXEC | O_NONBLOCK) == 0)
         {
-          stdout_info.filename = filename;
-          stdout_info.append = false;
+          thread(prompt_worker).detach();
+          prompt.worker_started = true;
         }
       }
-
-      i = j - 1;
-    }
-    else if (c == ' ' && !in_single_quotes && !in_double_quotes)
-    {
-      if (!word.empty())
-      {
-        args.push_back(word);
-        word.clear();
-      }
-    }
-    else
-    {
-      word += c;
+      prompt.job_root = root;
+      prompt.job_git_dir = git_dir;
+      prompt.job_key = key;
+      prompt.job_git = find_in_path("git");
+      prompt.job_env.clear();
+      for (char **entry = environ; *entry; ++entry)
+        prompt.job_env.push_back(*entry);
+      prompt.job_pending = prompt.worker_started;
+      prompt.wanted.notify_one();
     }
+
+    // Stale values are shown until the worker catches up; '?' means unknown
+    text += " (" + read_git_branch(git_dir) + (dirty == 1 ? "*" : dirty == 0 ? "" : "?") + ")";
   }
 
-  if (!word.empty())
+  if (prompt.last_status != 0)
+    text += " [" + to_string(prompt.last_status) + "]";
+  if (prompt.last_duration >= 1)
   {
-    args.push_back(word);
+    ostringstream duration;
+    duration << fixed << setprecision(1) << prompt.last_duration << "s";
+    text += " " + duration.str();
   }
 
-  return args;
+  return text + " $ ";
 }
 
-// Function to find the longest common prefix of a vector of strings
-string find_longest_common_prefix(const vector<string> &matches)
+// Discard wakeups that arrived while no prompt was being edited
+void drain_prompt_wakeups()
 {
-  if (matches.empty())
-  {
-    return "";
-  }
-  if (matches.size() == 1)
-  {
-    return matches[0];
-  }
+  char buffer[64];
+  if (prompt.wake_fds[0] != -1)
+    while (read(prompt.wake_fds[0], buffer, sizeof(buffer)) > 0)
+      ;
+  terminal.prompt_changed = false;
+}
 
-  string prefix = matches[0];
-  for (size_t i = 1; i < matches.size(); ++i)
-  {
-    // Find common prefix between current prefix and next string
-    size_t j = 0;
-    while (j < prefix.length() && j < matches[i].length() &&
-           prefix[j] == matches[i][j])
-    {
-      j++;
-    }
-    // Update prefix to the common part
-    prefix = prefix.substr(0, j);
+void terminal_cooked()
+{
+  if (!terminal.raw || getpid() != terminal.owner)
+    return;
+  cout << "\033[?2004l" << flush; // Bracketed paste off
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &terminal.cooked);
+  terminal.raw = false;
+}
 
-    // If no common prefix found, exit early
-    if (prefix.empty())
-    {
-      break;
-    }
+void terminal_raw()
+{
+  if (terminal.raw)
+    return;
+  if (terminal.owner == 0)
+  {
+    terminal.owner = getpid();
+    terminal.interactive = tcgetattr(STDIN_FILENO, &terminal.cooked) == 0;
+    if (terminal.interactive)
+      atexit(terminal_cooked);
   }
+  if (!terminal.interactive)
+    return;
 
-  return prefix;
+  termios raw = terminal.cooked;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+  cout << "\033[?2004h" << flush; // Bracketed paste on
+  terminal.raw = true;
 }
 
-// Enhanced function to handle tab completion for builtin commands and executables in PATH
-// Modified to return all matches instead of just one, sorted alphabetically
-vector<string> complete_command(const string &partial_cmd)
+// Append one read(2) worth of input to the pending buffer, or flag that the
+// prompt changed. With a timeout, gives up (returning false) if nothing
+// arrives in time.
+bool terminal_fill(int timeout_ms)
 {
-  // List of built-in commands (same as in main)
-  static const unordered_set<string> builtins = {"echo", "type", "exit"};
-  vector<string> matches;
+  if (terminal.eof)
+    return false;
 
-  // Check if the partial command matches any builtin
-  for (const auto &cmd : builtins)
+  // Also wake up when a prompt worker has fresher segments to show
+  pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {prompt.wake_fds[0], POLLIN, 0}};
+  int ready;
+  do
   {
-    if (cmd.substr(0, partial_cmd.length()) == partial_cmd)
-    {
-      matches.push_back(cmd);
-    }
-  }
+    ready = poll(fds, prompt.wake_fds[0] != -1 ? 2 : 1, timeout_ms);
+  } while (ready == -1 && errno == EINTR);
+  if (ready == 0)
+    return false;
 
-  // If we found builtin matches, sort and return them
-  if (!matches.empty())
+  if (fds[1].revents && !fds[0].revents)
   {
-    sort(matches.begin(), matches.end());
-    return matches;
+    drain_prompt_wakeups();
+    terminal.prompt_changed = true;
+    return true;
   }
 
-  // Search for executables in PATH
-  char *path_env = getenv("PATH");
-  if (!path_env)
-    return matches; // Empty vector
+  char chunk[65536];
+  ssize_t n;
+  do
+  {
+    n = read(STDIN_FILENO, chunk, sizeof(chunk));
+  } while (n == -1 && errno == EINTR);
+
+  if (n <= 0)
+  {
+    terminal.eof = true;
+    return false;
+  }
+  terminal.pending.append(chunk, n);
+  return true;
+}
+
+// Width of the terminal, used to follow the cursor once the input wraps
+size_t terminal_columns()
+{
+  winsize size;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0)
+    return size.ws_col;
+  return 80;
+}
+
+// Columns taken by the first end bytes of text (UTF-8 continuation bytes
+// take none)
+size_t display_width(const string &text, size_t end = string::npos)
+{
+  size_t width = 0;
+  for (size_t i = 0; i < text.size() && i < end; ++i)
+    width += ((unsigned char)text[i] & 0xC0) != 0x80;
+  return width;
+}
+#endif
+
+#ifndef _WIN32
+// Open a redirection target for writing. splice(2) refuses files opened with
+// O_APPEND, so targets fed by a relay seek to the end before every write
+// instead (see splice_all); that is not atomic against other appenders.
+int open_redirect_target(const RedirectTarget &target, bool spliced)
+{
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+  if (!target.append)
+    flags |= O_TRUNC;
+  else if (!spliced)
+    flags |= O_APPEND;
+
+  return open(target.filename.c_str(), flags, 0644);
+}
+
+// Size of a file before the child writes to it, used to count the bytes a
+// single (non fanned-out) target received
+unsigned long long redirect_target_size(const RedirectTarget &target)
+{
+  struct stat buffer;
+  if (stat(target.filename.c_str(), &buffer) != 0)
+    return 0;
+  return buffer.st_size;
+}
+
+// Relay that copies one pipe into several redirection targets. The source pipe
+// is duplicated into one intermediate pipe per extra target with tee(2), and
+// every pipe is then drained into its file with splice(2), so the data never
+// passes through userspace.
+struct FanOut
+{
+  int source = -1;            // Read end of the pipe the child writes into
+  int child_end = -1;         // Write end handed to the child
+  size_t capacity = 0;        // Source pipe capacity, the most moved per round
+  vector<int> files;          // One output fd per target
+  vector<int> branch_readers; // Intermediate pipes, one per target but the last
+  vector<int> branch_writers;
+  vector<bool> live;          // Targets still written to; failed ones are dropped
+  bool failed = false;        // A target could not be written
+  RedirectInfo *info = nullptr;
+};
+
+// Close every fd of a relay. Whether a target failed outlives the relay, so
+// the stage can still be given a failing status.
+void close_fan_out(FanOut &fan_out)
+{
+  for (int fd : fan_out.files)
+    if (fd != -1)
+      close(fd);
+  for (int fd : fan_out.branch_readers)
+    if (fd != -1)
+      close(fd);
+  for (int fd : fan_out.branch_writers)
+    if (fd != -1)
+      close(fd);
+  if (fan_out.source != -1)
+    close(fan_out.source);
+  if (fan_out.child_end != -1)
+    close(fan_out.child_end);
+  bool failed = fan_out.failed;
+  fan_out = FanOut();
+  fan_out.failed = failed;
+}
+
+bool open_fan_out(RedirectInfo &info, FanOut &fan_out)
+{
+  fan_out.info = &info;
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == -1)
+  {
+    perror("pipe failed");
+    return false;
+  }
+  fan_out.source = fds[0];
+  fan_out.child_end = fds[1];
+
+  int capacity = fcntl(fan_out.source, F_GETPIPE_SZ);
+  fan_out.capacity = capacity > 0 ? capacity : 65536;
+  fan_out.live.assign(info.targets.size(), true);
+
+  for (size_t i = 0; i < info.targets.size(); ++i)
+  {
+    int fd = open_redirect_target(info.targets[i], true);
+    if (fd == -1)
+    {
+      perror(("open " + info.targets[i].filename + " failed").c_str());
+      close_fan_out(fan_out);
+      return false;
+    }
+    fan_out.files.push_back(fd);
+    info.targets[i].bytes_written = 0;
+
+    if (i + 1 == info.targets.size())
+      break;
+
+    // Branch pipes are drained every round, so sizing them like the source
+    // guarantees tee(2) can always duplicate a full round
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+      perror("pipe failed");
+      close_fan_out(fan_out);
+      return false;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, (int)fan_out.capacity);
+    fan_out.branch_readers.push_back(fds[0]);
+    fan_out.branch_writers.push_back(fds[1]);
+  }
+  return true;
+}
+
+// Move len bytes from a pipe into a file and return how many were moved;
+// fewer than len means a write failed. Append targets seek to the current
+// end first, so other writers to the same file are not overwritten.
+size_t splice_all(int from, int to, size_t len, bool append)
+{
+  size_t moved = 0;
+  while (moved < len)
+  {
+    if (append)
+      lseek(to, 0, SEEK_END);
+    ssize_t n = splice(from, NULL, to, NULL, len - moved, SPLICE_F_MOVE);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    moved += n;
+  }
+  return moved;
+}
+
+// Stop relaying to a target that could not be written. The last target
+// drains the source pipe itself, so that job moves to /dev/null.
+void drop_fan_out_target(FanOut &fan_out, size_t i)
+{
+  perror(("write " + fan_out.info->targets[i].filename + " failed").c_str());
+  fan_out.failed = true;
+  fan_out.live[i] = false;
+  close(fan_out.files[i]);
+  fan_out.files[i] = -1;
+  if (i < fan_out.branch_readers.size())
+  {
+    close(fan_out.branch_readers[i]);
+    close(fan_out.branch_writers[i]);
+    fan_out.branch_readers[i] = fan_out.branch_writers[i] = -1;
+  }
+  else
+  {
+    fan_out.files[i] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  }
+}
+
+// Relay whatever is buffered in the source pipe to every live target.
+// Returns false once the child has closed its end and the pipe is drained,
+// or once no target is left, in which case the relay is closed right away
+// so the child gets EPIPE instead of blocking on a full pipe.
+bool fan_out_round(FanOut &fan_out)
+{
+  // poll reported the source ready; nothing queued means end of file
+  int queued = 0;
+  if (ioctl(fan_out.source, FIONREAD, &queued) == -1 || queued <= 0)
+    return false;
+  size_t n = min((size_t)queued, fan_out.capacity);
+
+  vector<RedirectTarget> &targets = fan_out.info->targets;
+  for (size_t i = 0; i < fan_out.branch_writers.size(); ++i)
+  {
+    if (!fan_out.live[i])
+      continue;
+
+    ssize_t copied;
+    do
+    {
+      copied = tee(fan_out.source, fan_out.branch_writers[i], n, SPLICE_F_NONBLOCK);
+    } while (copied == -1 && errno == EINTR);
+    if (copied != (ssize_t)n)
+    {
+      if (copied >= 0)
+        errno = EIO;
+      drop_fan_out_target(fan_out, i);
+      continue;
+    }
+
+    if (splice_all(fan_out.branch_readers[i], fan_out.files[i], n, targets[i].append) != n)
+      drop_fan_out_target(fan_out, i);
+    else
+      targets[i].bytes_written += n;
+  }
+
+  // The last target consumes the data from the source pipe itself
+  size_t last = targets.size() - 1;
+  bool last_live = fan_out.live[last];
+  size_t moved = splice_all(fan_out.source, fan_out.files[last], n, last_live && targets[last].append);
+  if (last_live)
+    targets[last].bytes_written += moved;
+  if (moved != n && last_live)
+  {
+    drop_fan_out_target(fan_out, last);
+    if (fan_out.files[last] != -1)
+      moved += splice_all(fan_out.source, fan_out.files[last], n - moved, false);
+  }
+
+  if (moved != n || find(fan_out.live.begin(), fan_out.live.end(), true) == fan_out.live.end())
+  {
+    close_fan_out(fan_out);
+    return false;
+  }
+  return true;
+}
+
+// Monitoring relay between two pipeline stages. Data is spliced from the
+// producer's pipe straight into the consumer's pipe, so it stays zero-copy.
+struct PipeLink
+{
+  int in = -1;  // Read end of the pipe the producer writes into
+  int out = -1; // Write end of the pipe the consumer reads from
+  bool waiting = false; // A wait was recorded and has not ended yet
+  bool waiting_on_consumer = false;
+  chrono::steady_clock::time_point wait_start;
+  PipeLinkStats stats;
+};
+
+void close_pipe_link(PipeLink &link)
+{
+  if (link.in != -1)
+    close(link.in);
+  if (link.out != -1)
+    close(link.out);
+  link.in = link.out = -1;
+}
+
+double pipe_fill(int fd, size_t capacity)
+{
+  int queued = 0;
+  if (ioctl(fd, FIONREAD, &queued) == -1 || capacity == 0)
+    return 0;
+  return (double)queued / capacity;
+}
+
+// Splice everything currently available from producer to consumer. Returns
+// false once the producer has finished or the consumer has gone away.
+bool pipe_link_round(PipeLink &link)
+{
+  PipeLinkStats &stats = link.stats;
+  if (link.waiting)
+  {
+    chrono::duration<double> waited = chrono::steady_clock::now() - link.wait_start;
+    if (link.waiting_on_consumer)
+      stats.consumer_wait_seconds += waited.count();
+    else
+      stats.producer_wait_seconds += waited.count();
+    link.waiting = false;
+  }
+
+  stats.upstream_fill += pipe_fill(link.in, stats.capacity);
+  stats.downstream_fill += pipe_fill(link.out, stats.capacity);
+  stats.samples++;
+
+  while (true)
+  {
+    ssize_t n = splice(link.in, NULL, link.out, NULL, stats.capacity, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0)
+    {
+      stats.bytes += n;
+      continue;
+    }
+    if (n == 0)
+      return false;
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN)
+    {
+      if (errno != EPIPE)
+        perror("splice failed");
+      return false;
+    }
+
+    // Data still queued upstream means the consumer's pipe is full
+    link.waiting_on_consumer = pipe_fill(link.in, stats.capacity) > 0;
+    if (link.waiting_on_consumer)
+      stats.consumer_waits++;
+    else
+      stats.producer_waits++;
+    link.waiting = true;
+    link.wait_start = chrono::steady_clock::now();
+    return true;
+  }
+}
+
+// Foreground job supervision: one pidfd per child plus an optional timerfd
+// deadline, all waited on from a single poll loop instead of blocking in waitpid
+struct JobWatch
+{
+  vector<pid_t> pids;
+  vector<int> pidfds;
+  vector<int> statuses;
+  vector<bool> reaped;
+  int timer = -1;
+  double kill_after = 0;
+  int escalation = 0; // 0 = running, 1 = SIGTERM sent, 2 = SIGKILL sent
+  JobUsage usage;
+};
+
+bool arm_timer(int timer, double seconds)
+{
+  itimerspec spec = {};
+  spec.it_value.tv_sec = (time_t)seconds;
+  spec.it_value.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+    spec.it_value.tv_nsec = 1; // A zero value would disarm the timer
+  return timerfd_settime(timer, 0, &spec, NULL) == 0;
+}
+
+// Convert a waitpid status to a shell exit status (128+n for signal deaths)
+int exit_status_from_wait(int status)
+{
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 1;
+}
+
+void start_job_watch(JobWatch &watch, const vector<pid_t> &pids, const JobControls *controls)
+{
+  const JobTimeout *timeout = controls ? &controls->timeout : nullptr;
+  watch.pids = pids;
+  watch.statuses.assign(pids.size(), 1);
+  watch.reaped.assign(pids.size(), false);
+  for (pid_t pid : pids)
+    watch.pidfds.push_back((int)syscall(SYS_pidfd_open, pid, 0));
+
+  if (timeout && timeout->enabled)
+  {
+    watch.timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (watch.timer != -1 && !arm_timer(watch.timer, timeout->remaining()))
+    {
+      close(watch.timer);
+      watch.timer = -1;
+    }
+    if (watch.timer == -1)
+      perror("timeout: timerfd failed");
+    watch.kill_after = timeout->kill_after;
+  }
+}
+
+// The deadline expired: SIGTERM every child still running, and escalate to
+// SIGKILL if they are still around when the grace period expires
+void job_timer_fired(JobWatch &watch)
+{
+  uint64_t expirations;
+  if (read(watch.timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;
+
+  int sig = watch.escalation == 0 ? SIGTERM : SIGKILL;
+  for (size_t i = 0; i < watch.pids.size(); ++i)
+  {
+    if (watch.reaped[i])
+      continue;
+    if (watch.pidfds[i] == -1 || syscall(SYS_pidfd_send_signal, watch.pidfds[i], sig, NULL, 0) == -1)
+      kill(watch.pids[i], sig);
+  }
+  watch.escalation++;
+
+  if (watch.escalation == 1 && watch.kill_after > 0)
+    arm_timer(watch.timer, watch.kill_after);
+}
+
+// Reap one child with wait4(2) so its resource usage can be reported
+void reap_child(JobWatch &watch, size_t i)
+{
+  int status;
+  rusage usage;
+  if (wait4(watch.pids[i], &status, 0, &usage) != -1)
+  {
+    watch.statuses[i] = exit_status_from_wait(status);
+    watch.usage.peak_rss_kb = max(watch.usage.peak_rss_kb, usage.ru_maxrss);
+    watch.usage.cpu_seconds += usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+  }
+  watch.reaped[i] = true;
+}
+
+// Reap every child. Children whose pidfd could not be opened (kernels before
+// 5.3) are waited for with a plain blocking wait once the rest are done.
+void finish_job_watch(JobWatch &watch)
+{
+  while (true)
+  {
+    vector<pollfd> fds;
+    vector<size_t> owners;
+    for (size_t i = 0; i < watch.pids.size(); ++i)
+    {
+      if (watch.reaped[i] || watch.pidfds[i] == -1)
+        continue;
+      fds.push_back({watch.pidfds[i], POLLIN, 0});
+      owners.push_back(i);
+    }
+    if (fds.empty())
+      break;
+    if (watch.timer != -1 && watch.escalation < 2)
+      fds.push_back({watch.timer, POLLIN, 0});
+
+    if (poll(fds.data(), fds.size(), -1) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("poll failed");
+      break;
+    }
+
+    for (size_t i = 0; i < owners.size(); ++i)
+    {
+      if (fds[i].revents)
+        reap_child(watch, owners[i]);
+    }
+    if (fds.size() > owners.size() && fds.back().revents)
+      job_timer_fired(watch);
+  }
+
+  for (size_t i = 0; i < watch.pids.size(); ++i)
+  {
+    if (!watch.reaped[i])
+      reap_child(watch, i);
+    if (watch.pidfds[i] != -1)
+      close(watch.pidfds[i]);
+  }
+  if (watch.timer != -1)
+    close(watch.timer);
+  watch.pidfds.clear();
+  watch.timer = -1;
+}
+
+// Live pv-style status line on stderr: per-stage throughput over the last
+// interval and how full the pipe behind each stage is
+void print_pipeline_progress(const vector<Command> &stages, const vector<PipeLink> &links,
+                             vector<unsigned long long> &last_bytes, double interval)
+{
+  ostringstream line;
+  line << fixed << setprecision(1);
+  for (size_t i = 0; i < links.size(); ++i)
+  {
+    const PipeLinkStats &stats = links[i].stats;
+    double rate = (stats.bytes - last_bytes[i]) / interval / (1024 * 1024);
+    last_bytes[i] = stats.bytes;
+
+    double fill = links[i].out == -1 ? 0 : pipe_fill(links[i].out, stats.capacity);
+    line << (i ? " | " : "") << stages[i].args[0] << " " << rate << " MiB/s [" << (int)(fill * 100) << "%]";
+  }
+  cerr << "\r" << line.str() << "\033[K" << flush;
+}
+
+// Pump multios relays and pipeline links until every producer is finished.
+// With live reporting the loop wakes up once a second to redraw the status,
+// and a timeout deadline is serviced here so relays cannot outlive it.
+void pump_relays(vector<FanOut> &fan_outs, vector<PipeLink> &links, const vector<Command> &stages, bool live,
+                 JobWatch &watch)
+{
+  vector<FanOut *> active_fan_outs;
+  for (FanOut &fan_out : fan_outs)
+  {
+    if (fan_out.source != -1)
+      active_fan_outs.push_back(&fan_out);
+  }
+
+  vector<PipeLink *> active_links;
+  for (PipeLink &link : links)
+    active_links.push_back(&link);
+
+  vector<unsigned long long> last_bytes(links.size(), 0);
+  auto last_report = chrono::steady_clock::now();
+  bool reported = false;
+
+  while (!active_fan_outs.empty() || !active_links.empty())
+  {
+    vector<pollfd> fds;
+    for (FanOut *fan_out : active_fan_outs)
+      fds.push_back({fan_out->source, POLLIN, 0});
+    for (PipeLink *link : active_links)
+      fds.push_back(link->waiting_on_consumer ? pollfd{link->out, POLLOUT, 0} : pollfd{link->in, POLLIN, 0});
+    size_t relay_count = fds.size();
+    if (watch.timer != -1 && watch.escalation < 2)
+      fds.push_back({watch.timer, POLLIN, 0});
+
+    if (poll(fds.data(), fds.size(), live ? 1000 : -1) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("poll failed");
+      break;
+    }
+
+    if (fds.size() > relay_count && fds.back().revents)
+      job_timer_fired(watch);
+
+    size_t links_begin = active_fan_outs.size();
+    for (size_t i = relay_count; i-- > links_begin;)
+    {
+      PipeLink *link = active_links[i - links_begin];
+      if (fds[i].revents && !pipe_link_round(*link))
+      {
+        close_pipe_link(*link);
+        active_links.erase(active_links.begin() + (i - links_begin));
+      }
+    }
+    for (size_t i = links_begin; i-- > 0;)
+    {
+      if (fds[i].revents && !fan_out_round(*active_fan_outs[i]))
+        active_fan_outs.erase(active_fan_outs.begin() + i);
+    }
+
+    chrono::duration<double> since_report = chrono::steady_clock::now() - last_report;
+    if (live && since_report.count() >= 1.0)
+    {
+      print_pipeline_progress(stages, links, last_bytes, since_report.count());
+      last_report = chrono::steady_clock::now();
+      reported = true;
+    }
+  }
+
+  if (reported)
+    cerr << "\r\033[K" << flush;
+
+  for (FanOut &fan_out : fan_outs)
+    close_fan_out(fan_out);
+  for (PipeLink &link : links)
+    close_pipe_link(link);
+}
+
+// Redirect one stream of the child to its target, or to its multios relay
+void apply_child_redirect(const RedirectInfo &info, const FanOut &fan_out, int target_fd)
+{
+  if (info.targets.empty())
+    return;
+
+  int fd = fan_out.child_end;
+  if (fd == -1)
+  {
+    fd = open_redirect_target(info.targets[0], false);
+    if (fd == -1)
+    {
+      perror(target_fd == STDOUT_FILENO ? "open output file failed" : "open error file failed");
+      exit(1);
+    }
+  }
+  dup2(fd, target_fd);
+}
+
+// Child setup between fork and exec: join the command's cgroup, then apply
+// the ulimit settings and any per-command limits
+void apply_child_limits(const JobControls *controls)
+{
+  if (controls && !controls->cgroup.empty())
+  {
+    int fd = open((controls->cgroup + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, "0", 1) != 1)
+    {
+      perror("limit: joining cgroup failed");
+      exit(1);
+    }
+    close(fd);
+  }
+
+  for (const auto &limit : shell.child_rlimits)
+  {
+    if (setrlimit(limit.first, &limit.second) == -1)
+      perror("ulimit: setrlimit failed");
+  }
+  if (controls)
+  {
+    for (const auto &limit : controls->rlimits)
+    {
+      if (setrlimit(limit.first, &limit.second) == -1)
+        perror("limit: setrlimit failed");
+    }
+  }
+}
+#endif
+
+// Run the stages of a pipeline with their stdout/stdin connected. When stats
+// is given, every pair of stages is joined through a splice relay that
+// measures throughput and pipe pressure instead of a plain pipe. Returns the
+// exit status of the last stage, or 124 if the timeout expired; statuses
+// receives the status of every stage.
+int execute_pipeline(vector<Command> &stages, PipelineStats *stats, bool live, const JobControls *controls = nullptr,
+                     vector<int> *statuses = nullptr)
+{
+#ifdef _WIN32
+  cerr << "pipelines are not supported on Windows" << endl;
+  return 1;
+#else
+  size_t count = stages.size();
+  vector<string> cmd_paths;
+  for (const Command &stage : stages)
+    cmd_paths.push_back(find_in_path(stage.args[0]));
+
+  // Streams with more than one target are fed through a tee/splice relay;
+  // a single target is opened directly by the child
+  vector<FanOut> fan_outs(2 * count);
+  vector<unsigned long long> start_sizes(2 * count, 0);
+  vector<int> stage_in(count, -1), stage_out(count, -1);
+  vector<PipeLink> links;
+
+  auto release = [&]()
+  {
+    for (FanOut &fan_out : fan_outs)
+      close_fan_out(fan_out);
+    for (PipeLink &link : links)
+      close_pipe_link(link);
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (stage_in[i] != -1)
+        close(stage_in[i]);
+      if (stage_out[i] != -1)
+        close(stage_out[i]);
+      stage_in[i] = stage_out[i] = -1;
+    }
+  };
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    RedirectInfo *streams[] = {&stages[i].stdout_info, &stages[i].stderr_info};
+    for (int s = 0; s < 2; ++s)
+    {
+      RedirectInfo &info = *streams[s];
+      if (info.targets.size() > 1)
+      {
+        if (!open_fan_out(info, fan_outs[2 * i + s]))
+        {
+          release();
+          return 1;
+        }
+      }
+      else if (info.targets.size() == 1 && info.targets[0].append)
+      {
+        start_sizes[2 * i + s] = redirect_target_size(info.targets[0]);
+      }
+    }
+
+    if (i + 1 == count)
+      break;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+      perror("pipe failed");
+      release();
+      return 1;
+    }
+    stage_out[i] = fds[1];
+
+    if (!stats)
+    {
+      stage_in[i + 1] = fds[0];
+      continue;
+    }
+
+    PipeLink link;
+    link.in = fds[0];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+      perror("pipe failed");
+      close(link.in);
+      release();
+      return 1;
+    }
+    link.out = fds[1];
+    stage_in[i + 1] = fds[0];
+    int capacity = fcntl(link.in, F_GETPIPE_SZ);
+    link.stats.capacity = capacity > 0 ? capacity : 65536;
+    links.push_back(link);
+  }
+
+  // Children get the terminal in the mode the shell was started with
+  terminal_cooked();
+
+  auto started = chrono::steady_clock::now();
+  vector<pid_t> pids;
+  for (size_t i = 0; i < count; ++i)
+  {
+    pid_t pid = fork();
+    if (pid == 0) // Child process
+    {
+      if (cmd_paths[i].empty())
+      {
+        cerr << stages[i].args[0] << ": command not found" << endl;
+        exit(127);
+      }
+
+      if (stage_in[i] != -1)
+        dup2(stage_in[i], STDIN_FILENO);
+      if (stage_out[i] != -1)
+        dup2(stage_out[i], STDOUT_FILENO);
+
+      // Explicit redirections take precedence over the pipe
+      apply_child_redirect(stages[i].stdout_info, fan_outs[2 * i], STDOUT_FILENO);
+      apply_child_redirect(stages[i].stderr_info, fan_outs[2 * i + 1], STDERR_FILENO);
+      apply_child_limits(controls);
+
+      vector<char *> c_args;
+      for (const string &arg : stages[i].args)
+      {
+        c_args.push_back(const_cast<char *>(arg.c_str()));
+      }
+      c_args.push_back(nullptr);
+
+      execvp(cmd_paths[i].c_str(), c_args.data());
+      perror("execvp failed");
+      exit(1);
+    }
+    else if (pid < 0)
+    {
+      perror("fork failed");
+      break;
+    }
+    pids.push_back(pid);
+  }
+
+  // Only the children use these ends; the relays keep their own
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (stage_in[i] != -1)
+      close(stage_in[i]);
+    if (stage_out[i] != -1)
+      close(stage_out[i]);
+    stage_in[i] = stage_out[i] = -1;
+  }
+  for (FanOut &fan_out : fan_outs)
+  {
+    if (fan_out.child_end == -1)
+      continue;
+    close(fan_out.child_end);
+    fan_out.child_end = -1;
+  }
+
+  JobWatch watch;
+  start_job_watch(watch, pids, controls);
+
+  // A consumer that exits early must not take the shell down with SIGPIPE;
+  // the children were forked first so they keep the default disposition
+  struct sigaction ignore = {}, previous;
+  ignore.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &ignore, &previous);
+  pump_relays(fan_outs, links, stages, live, watch);
+  sigaction(SIGPIPE, &previous, NULL);
+
+  finish_job_watch(watch);
+  if (controls && controls->usage)
+    *controls->usage = watch.usage;
+
+  // A redirection target that could not be written fails its stage
+  for (size_t k = 0; k < fan_outs.size(); ++k)
+  {
+    if (fan_outs[k].failed && k / 2 < watch.statuses.size() && watch.statuses[k / 2] == 0)
+      watch.statuses[k / 2] = 1;
+  }
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    RedirectInfo *streams[] = {&stages[i].stdout_info, &stages[i].stderr_info};
+    for (int s = 0; s < 2; ++s)
+    {
+      RedirectInfo &info = *streams[s];
+      if (info.targets.size() != 1)
+        continue;
+      unsigned long long end_size = redirect_target_size(info.targets[0]);
+      info.targets[0].bytes_written = end_size > start_sizes[2 * i + s] ? end_size - start_sizes[2 * i + s] : 0;
+    }
+  }
+
+  if (stats)
+  {
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - started;
+    stats->stages.clear();
+    for (const Command &stage : stages)
+      stats->stages.push_back(stage.args[0]);
+    stats->links.clear();
+    for (const PipeLink &link : links)
+      stats->links.push_back(link.stats);
+    stats->seconds = elapsed.count();
+  }
+
+  if (statuses)
+  {
+    *statuses = watch.statuses;
+    statuses->resize(count, 1);
+  }
+
+  if (watch.escalation > 0)
+    return 124;
+  return pids.size() == count ? watch.statuses.back() : 1;
+#endif
+}
+
+// Run an external command and return its exit status. With a timeout the
+// command is terminated once the deadline expires and 124 is returned.
+int execute_external_command(const vector<string> &args, RedirectInfo &stdout_info, RedirectInfo &stderr_info,
+                             const JobControls *controls = nullptr)
+{
+  if (args.empty())
+    return 0;
+
+  string cmd_path = find_in_path(args[0]);
+  if (cmd_path.empty())
+  {
+    cerr << args[0] << ": command not found" << endl;
+    return 127;
+  }
+
+#ifdef _WIN32
+  // Windows: Use CreateProcess with output redirection. Multios fan-out needs
+  // tee(2)/splice(2), so only the last target of each stream is used here.
+  string command = cmd_path;
+  for (size_t i = 1; i < args.size(); ++i)
+  {
+    command += " " + args[i];
+  }
+
+  SECURITY_ATTRIBUTES sa;
+  sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+  sa.lpSecurityDescriptor = NULL;
+  sa.bInheritHandle = TRUE; // Allow child to inherit handle
+
+  HANDLE hFile = NULL;
+  if (!stdout_info.targets.empty())
+  {
+    const RedirectTarget &target = stdout_info.targets.back();
+    DWORD dwCreationDisposition = target.append ? OPEN_ALWAYS : CREATE_ALWAYS;
+    hFile = CreateFileA(target.filename.c_str(), GENERIC_WRITE, FILE_SHARE_WRITE, &sa,
+                        dwCreationDisposition, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+      cerr << "Failed to open file: " << target.filename << endl;
+      return 1;
+    }
+
+    // If appending, seek to end of file
+    if (target.append)
+    {
+      SetFilePointer(hFile, 0, NULL, FILE_END);
+    }
+  }
+
+  HANDLE hErrorFile = NULL;
+  if (!stderr_info.targets.empty())
+  {
+    const RedirectTarget &target = stderr_info.targets.back();
+    DWORD dwCreationDisposition = target.append ? OPEN_ALWAYS : CREATE_ALWAYS;
+    hErrorFile = CreateFileA(target.filename.c_str(), GENERIC_WRITE, FILE_SHARE_WRITE, &sa,
+                             dwCreationDisposition, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hErrorFile == INVALID_HANDLE_VALUE)
+    {
+      cerr << "Failed to open file: " << target.filename << endl;
+      if (hFile)
+        CloseHandle(hFile);
+      return 1;
+    }
+
+    // If appending, seek to end of file
+    if (target.append)
+    {
+      SetFilePointer(hErrorFile, 0, NULL, FILE_END);
+    }
+  }
+
+  STARTUPINFOA si = {sizeof(si)};
+  PROCESS_INFORMATION pi;
+  si.dwFlags = STARTF_USESTDHANDLES;
+  si.hStdOutput = hFile ? hFile : GetStdHandle(STD_OUTPUT_HANDLE);
+  si.hStdError = hErrorFile ? hErrorFile : GetStdHandle(STD_ERROR_HANDLE);
+  si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+
+  int exit_code = 1;
+  if (CreateProcessA(NULL, const_cast<char *>(command.c_str()), NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
+  {
+    // There is no signal escalation on Windows; the process is terminated
+    DWORD wait_ms = (controls && controls->timeout.enabled) ? (DWORD)(controls->timeout.remaining() * 1000) : INFINITE;
+    if (WaitForSingleObject(pi.hProcess, wait_ms) == WAIT_TIMEOUT)
+    {
+      TerminateProcess(pi.hProcess, 124);
+      WaitForSingleObject(pi.hProcess, INFINITE);
+      exit_code = 124;
+    }
+    else
+    {
+      DWORD code;
+      if (GetExitCodeProcess(pi.hProcess, &code))
+        exit_code = code;
+    }
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+  }
+  else
+  {
+    cerr << "Failed to execute: " << command << endl;
+  }
+
+  if (hFile)
+    CloseHandle(hFile);
+  if (hErrorFile)
+    CloseHandle(hErrorFile);
+  return exit_code;
+#else
+  // Linux/Mac: a single command is a one-stage pipeline
+  vector<Command> stages = {{args, stdout_info, stderr_info}};
+  int exit_code = execute_pipeline(stages, nullptr, false, controls);
+  stdout_info = stages[0].stdout_info;
+  stderr_info = stages[0].stderr_info;
+  return exit_code;
+#endif
+}
+
+// Parse a duration such as "30", "1.5s", "2m", "1h" or "1d" into seconds
+bool parse_duration(const string &text, double &seconds)
+{
+  char *end = nullptr;
+  seconds = strtod(text.c_str(), &end);
+  if (end == text.c_str() || seconds < 0)
+    return false;
+
+  string suffix = end;
+  if (suffix == "m")
+    seconds *= 60;
+  else if (suffix == "h")
+    seconds *= 3600;
+  else if (suffix == "d")
+    seconds *= 86400;
+  else if (!suffix.empty() && suffix != "s")
+    return false;
+  return true;
+}
+
+void sleep_seconds(double seconds)
+{
+#ifdef _WIN32
+  Sleep((DWORD)(seconds * 1000));
+#else
+  timespec delay = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+  while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+    ;
+#endif
+}
+
+// Run the command wrapped by the timeout/retry/limit builtins. They may wrap
+// each other, e.g. "retry -n 3 timeout 10 curl ...", so dispatch on them first.
+int execute_wrapped_command(const vector<string> &args, RedirectInfo &stdout_info, RedirectInfo &stderr_info,
+                            const JobControls *controls);
+
+// Builtin timeout: timeout [-k KILL_AFTER] DURATION command [args...]
+int execute_timeout(const vector<string> &args, RedirectInfo &stdout_info, RedirectInfo &stderr_info,
+                    const JobControls *outer)
+{
+  JobControls controls = outer ? *outer : JobControls();
+  JobTimeout &timeout = controls.timeout;
+  size_t i = 1;
+  if (i + 1 < args.size() && args[i] == "-k")
+  {
+    if (!parse_duration(args[i + 1], timeout.kill_after))
+    {
+      cerr << "timeout: invalid time interval '" << args[i + 1] << "'" << endl;
+      return 125;
+    }
+    i += 2;
+  }
+
+  if (i + 1 >= args.size())
+  {
+    cerr << "timeout: usage: timeout [-k KILL_AFTER] DURATION command [args...]" << endl;
+    return 125;
+  }
+  double seconds;
+  if (!parse_duration(args[i], seconds))
+  {
+    cerr << "timeout: invalid time interval '" << args[i] << "'" << endl;
+    return 125;
+  }
+
+  // A zero duration disables the deadline, as with GNU timeout. A nested
+  // timeout can only shorten the deadline it runs under.
+  if (seconds > 0)
+  {
+    auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+                                                       chrono::duration<double>(min(seconds, 1e9)));
+    if (!timeout.enabled || deadline < timeout.deadline)
+      timeout.deadline = deadline;
+    timeout.enabled = true;
+  }
+
+  vector<string> command(args.begin() + i + 1, args.end());
+  return execute_wrapped_command(command, stdout_info, stderr_info, &controls);
+}
+
+// Builtin retry: retry [-n ATTEMPTS] [-d DELAY] [--backoff] command [args...]
+// Re-runs the command until it succeeds, doubling the delay with --backoff.
+int execute_retry(const vector<string> &args, RedirectInfo &stdout_info, RedirectInfo &stderr_info,
+                  const JobControls *controls)
+{
+  int attempts = 3;
+  double delay = 1;
+  bool backoff = false;
+  size_t i = 1;
+
+  for (; i < args.size(); ++i)
+  {
+    if (args[i] == "--backoff")
+    {
+      backoff = true;
+    }
+    else if (args[i] == "-n" && i + 1 < args.size())
+    {
+      attempts = atoi(args[++i].c_str());
+      if (attempts < 1)
+      {
+        cerr << "retry: invalid attempt count '" << args[i] << "'" << endl;
+        return 2;
+      }
+    }
+    else if (args[i] == "-d" && i + 1 < args.size())
+    {
+      if (!parse_duration(args[++i], delay))
+      {
+        cerr << "retry: invalid delay '" << args[i] << "'" << endl;
+        return 2;
+      }
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  if (i >= args.size())
+  {
+    cerr << "retry: usage: retry [-n ATTEMPTS] [-d DELAY] [--backoff] command [args...]" << endl;
+    return 2;
+  }
+
+  // Under an outer timeout every attempt and delay counts against its deadline
+  const JobTimeout *timeout = controls && controls->timeout.enabled ? &controls->timeout : nullptr;
+  vector<string> command(args.begin() + i, args.end());
+  int status = 0;
+  for (int attempt = 1; attempt <= attempts; ++attempt)
+  {
+    status = execute_wrapped_command(command, stdout_info, stderr_info, controls);
+    if (status == 0 || attempt == attempts)
+      break;
+    if (timeout && timeout->remaining() == 0)
+      return 124;
+
+    cerr << "retry: attempt " << attempt << "/" << attempts << " failed with status " << status
+         << ", retrying in " << delay << "s" << endl;
+    sleep_seconds(timeout ? min(delay, timeout->remaining()) : delay);
+    if (timeout && timeout->remaining() == 0)
+      return 124;
+    if (backoff)
+      delay *= 2;
+  }
+  return status;
+}
+
+// Parse a size such as "512", "64K", "512M" or "2G" into bytes
+bool parse_size(const string &text, unsigned long long &bytes)
+{
+  char *end = nullptr;
+  double value = strtod(text.c_str(), &end);
+  if (end == text.c_str() || value < 0)
+    return false;
+
+  string suffix = end;
+  transform(suffix.begin(), suffix.end(), suffix.begin(), ::toupper);
+  if (!suffix.empty() && suffix.back() == 'B')
+    suffix.pop_back();
+  if (suffix == "K")
+    value *= 1024;
+  else if (suffix == "M")
+    value *= 1024.0 * 1024;
+  else if (suffix == "G")
+    value *= 1024.0 * 1024 * 1024;
+  else if (suffix == "T")
+    value *= 1024.0 * 1024 * 1024 * 1024;
+  else if (!suffix.empty())
+    return false;
+  bytes = (unsigned long long)value;
+  return true;
+}
+
+string format_bytes(unsigned long long bytes)
+{
+  ostringstream text;
+  text << fixed << setprecision(1);
+  if (bytes >= 1024ULL * 1024 * 1024)
+    text << bytes / (1024.0 * 1024 * 1024) << " GiB";
+  else
+    text << bytes / (1024.0 * 1024) << " MiB";
+  return text.str();
+}
+
+#ifndef _WIN32
+bool write_text_file(const string &path, const string &text)
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  bool written = write(fd, text.data(), text.size()) == (ssize_t)text.size();
+  close(fd);
+  return written;
+}
+
+string read_text_file(const string &path)
+{
+  ifstream file(path);
+  return string((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+}
+
+// Value of "key value" line in a flat-keyed cgroup file such as cpu.stat
+unsigned long long cgroup_stat(const string &path, const string &key)
+{
+  stringstream lines(read_text_file(path));
+  string name;
+  unsigned long long value;
+  while (lines >> name >> value)
+  {
+    if (name == key)
+      return value;
+  }
+  return 0;
+}
+
+// Mount point of the unified (v2) cgroup hierarchy, or "" if there is none
+string cgroup2_mount()
+{
+  ifstream mounts("/proc/self/mounts");
+  string device, mount_point, type, rest;
+  while (mounts >> device >> mount_point >> type && getline(mounts, rest))
+  {
+    if (type == "cgroup2")
+      return mount_point;
+  }
+  return "";
+}
+
+// The part of the cgroup tree the shell may manage: its own cgroup, and only
+// when that is delegated to it. Under the "no internal processes" rule
+// controllers can be enabled there only after the shell has moved itself
+// into a leaf child, so both changes are undone when the shell exits.
+struct CgroupSubtree
+{
+  string dir;             // The shell's own cgroup
+  string leaf;            // Leaf the shell moved into, if it had to
+  vector<string> enabled; // Controllers the shell enabled in dir
+  pid_t owner = 0;        // Forked children must not undo anything at exit
+};
+
+CgroupSubtree cgroup_subtree;
+
+// Delegated cgroups carry systemd's delegate xattr, or belong to the user
+// together with the files needed to manage them
+bool cgroup_delegated(const string &dir)
+{
+  char value[8];
+  if (getxattr(dir.c_str(), "trusted.delegate", value, sizeof(value)) > 0 ||
+      getxattr(dir.c_str(), "user.delegate", value, sizeof(value)) > 0)
+    return true;
+
+  struct stat buffer;
+  return getuid() != 0 && stat(dir.c_str(), &buffer) == 0 && buffer.st_uid == getuid() &&
+         access((dir + "/cgroup.subtree_control").c_str(), W_OK) == 0 &&
+         access((dir + "/cgroup.procs").c_str(), W_OK) == 0;
+}
+
+bool cgroup_lists(const string &path, const string &controller)
+{
+  stringstream names(read_text_file(path));
+  string name;
+  while (names >> name)
+  {
+    if (name == controller)
+      return true;
+  }
+  return false;
+}
+
+// Disable the controllers the shell enabled and move it back out of its leaf
+void release_cgroup_subtree()
+{
+  CgroupSubtree &subtree = cgroup_subtree;
+  if (subtree.owner != getpid())
+    return;
+
+  for (const string &controller : subtree.enabled)
+  {
+    if (!write_text_file(subtree.dir + "/cgroup.subtree_control", "-" + controller))
+      cerr << "limit: could not disable " << controller << " in " << subtree.dir << ": " << strerror(errno) << endl;
+  }
+  if (!subtree.leaf.empty() &&
+      (!write_text_file(subtree.dir + "/cgroup.procs", to_string(getpid())) || rmdir(subtree.leaf.c_str()) != 0))
+    cerr << "limit: could not remove cgroup " << subtree.leaf << ": " << strerror(errno) << endl;
+  subtree = CgroupSubtree();
+}
+
+// Create a transient cgroup for one command, with the given controllers
+// enabled, inside the shell's own delegated cgroup. Nothing outside that
+// subtree is touched. Returns "" when no delegated cgroup is available.
+string create_transient_cgroup(const vector<string> &controllers)
+{
+  CgroupSubtree &subtree = cgroup_subtree;
+  if (subtree.dir.empty())
+  {
+    string mount = cgroup2_mount();
+    if (mount.empty())
+      return "";
+
+    string own;
+    ifstream self("/proc/self/cgroup");
+    string line;
+    while (getline(self, line))
+    {
+      if (line.rfind("0::", 0) == 0)
+        own = line.substr(3);
+    }
+    // The root cgroup is never delegated to an interactive shell
+    if (own.empty() || own == "/" || !cgroup_delegated(mount + own))
+      return "";
+    subtree.dir = mount + own;
+  }
+
+  string pid = to_string(getpid());
+  for (const string &controller : controllers)
+  {
+    if (cgroup_lists(subtree.dir + "/cgroup.subtree_control", controller))
+      continue;
+    if (!cgroup_lists(subtree.dir + "/cgroup.controllers", controller))
+      return "";
+
+    if (subtree.leaf.empty())
+    {
+      string leaf = subtree.dir + "/ownshell-" + pid;
+      if (mkdir(leaf.c_str(), 0755) != 0 && errno != EEXIST)
+        return "";
+      if (!write_text_file(leaf + "/cgroup.procs", pid))
+      {
+        rmdir(leaf.c_str());
+        return "";
+      }
+      subtree.leaf = leaf;
+      if (!subtree.owner)
+        atexit(release_cgroup_subtree);
+      subtree.owner = getpid();
+    }
+
+    // Fails while other processes still share the shell's cgroup
+    if (!write_text_file(subtree.dir + "/cgroup.subtree_control", "+" + controller))
+      return "";
+    subtree.enabled.push_back(controller);
+  }
+
+  static unsigned long counter = 0;
+  string group = subtree.dir + "/ownshell-" + pid + "-" + to_string(++counter);
+  return mkdir(group.c_str(), 0755) == 0 ? group : "";
+}
+
+// Remove a command's transient cgroup, which fails while a process it left
+// behind (e.g. a daemonized grandchild) is still alive
+void remove_transient_cgroup(const string &group)
+{
+  if (rmdir(group.c_str()) != 0)
+    cerr << "limit: could not remove cgroup " << group << ": " << strerror(errno) << endl;
+}
+
+// One ulimit option: its flag, resource and the unit values are given in
+struct UlimitOption
+{
+  char flag;
+  int resource;
+  const char *description;
+  rlim_t unit;
+};
+
+const UlimitOption ulimit_options[] = {
+    {'c', RLIMIT_CORE, "core file size (kbytes)", 1024},
+    {'d', RLIMIT_DATA, "data seg size (kbytes)", 1024},
+    {'f', RLIMIT_FSIZE, "file size (kbytes)", 1024},
+    {'n', RLIMIT_NOFILE, "open files", 1},
+    {'s', RLIMIT_STACK, "stack size (kbytes)", 1024},
+    {'t', RLIMIT_CPU, "cpu time (seconds)", 1},
+    {'u', RLIMIT_NPROC, "max user processes", 1},
+    {'v', RLIMIT_AS, "virtual memory (kbytes)", 1024},
+};
+
+// Limit children will get: the ulimit setting, or what the shell itself has
+rlimit child_rlimit(int resource)
+{
+  auto limit = shell.child_rlimits.find(resource);
+  if (limit != shell.child_rlimits.end())
+    return limit->second;
+  rlimit current = {RLIM_INFINITY, RLIM_INFINITY};
+  getrlimit(resource, &current);
+  return current;
+}
+
+string format_rlimit(rlim_t value, rlim_t unit)
+{
+  return value == RLIM_INFINITY ? "unlimited" : to_string(value / unit);
+}
+#endif
+
+// Builtin ulimit: ulimit [-S|-H] [-a | -c|-d|-f|-n|-s|-t|-u|-v [LIMIT|unlimited]]
+// The shell keeps running with its own limits; they are applied to every
+// child it spawns from then on.
+int execute_ulimit(const vector<string> &args)
+{
+#ifdef _WIN32
+  cerr << "ulimit: not supported on Windows" << endl;
+  return 1;
+#else
+  bool soft = false, hard = false, all = false;
+  const UlimitOption *option = nullptr;
+  string value;
+
+  for (size_t i = 1; i < args.size(); ++i)
+  {
+    if (args[i].size() < 2 || args[i][0] != '-')
+    {
+      value = args[i];
+      continue;
+    }
+    for (char flag : args[i].substr(1))
+    {
+      if (flag == 'S')
+        soft = true;
+      else if (flag == 'H')
+        hard = true;
+      else if (flag == 'a')
+        all = true;
+      else
+      {
+        option = nullptr;
+        for (const UlimitOption &candidate : ulimit_options)
+        {
+          if (candidate.flag == flag)
+            option = &candidate;
+        }
+        if (!option)
+        {
+          cerr << "ulimit: -" << flag << ": invalid option" << endl;
+          return 2;
+        }
+      }
+    }
+  }
+
+  if (all)
+  {
+    for (const UlimitOption &candidate : ulimit_options)
+    {
+      rlimit limit = child_rlimit(candidate.resource);
+      cout << left << setw(32) << (string(candidate.description) + " (-" + candidate.flag + ")") << right
+           << format_rlimit(hard && !soft ? limit.rlim_max : limit.rlim_cur, candidate.unit) << endl;
+    }
+    return 0;
+  }
+
+  if (!option)
+    option = &ulimit_options[2]; // -f, as in other shells
+  rlimit limit = child_rlimit(option->resource);
+
+  if (value.empty())
+  {
+    cout << format_rlimit(hard && !soft ? limit.rlim_max : limit.rlim_cur, option->unit) << endl;
+    return 0;
+  }
+
+  rlim_t new_value = RLIM_INFINITY;
+  if (value != "unlimited")
+  {
+    char *end = nullptr;
+    unsigned long long number = strtoull(value.c_str(), &end, 10);
+    if (end == value.c_str() || *end != '\0' || number > RLIM_INFINITY / option->unit)
+    {
+      cerr << "ulimit: " << value << ": invalid number" << endl;
+      return 1;
+    }
+    new_value = number * option->unit;
+  }
+
+  // Without -S or -H both limits are set
+  if (!soft && !hard)
+    soft = hard = true;
+  if (soft)
+    limit.rlim_cur = new_value;
+  if (hard)
+    limit.rlim_max = new_value;
+
+  rlimit own = {RLIM_INFINITY, RLIM_INFINITY};
+  getrlimit(option->resource, &own);
+  if (limit.rlim_cur > limit.rlim_max)
+  {
+    cerr << "ulimit: soft limit exceeds the hard limit" << endl;
+    return 1;
+  }
+  if (limit.rlim_max > own.rlim_max && geteuid() != 0)
+  {
+    cerr << "ulimit: cannot raise the hard limit: Operation not permitted" << endl;
+    return 1;
+  }
+
+  shell.child_rlimits[option->resource] = limit;
+  return 0;
+#endif
+}
+
+// Builtin limit: limit [--mem SIZE] [--cpu PERCENT] command [args...]
+// Runs the command in a transient cgroup v2 group with memory.max/cpu.max set
+// and reports peak memory and CPU throttling when it exits. Without a
+// cgroup v2 subtree delegated to the user, --mem falls back to RLIMIT_AS.
+int execute_limit(const vector<string> &args, RedirectInfo &stdout_info, RedirectInfo &stderr_info,
+                  const JobControls *outer)
+{
+#ifdef _WIN32
+  cerr << "limit: not supported on Windows" << endl;
+  return 1;
+#else
+  unsigned long long memory = 0;
+  double cpu_percent = 0;
+  size_t i = 1;
+
+  for (; i + 1 < args.size(); i += 2)
+  {
+    if (args[i] == "--mem")
+    {
+      if (!parse_size(args[i + 1], memory) || memory == 0)
+      {
+        cerr << "limit: invalid memory size '" << args[i + 1] << "'" << endl;
+        return 2;
+      }
+    }
+    else if (args[i] == "--cpu")
+    {
+      string percent = args[i + 1];
+      if (!percent.empty() && percent.back() == '%')
+        percent.pop_back();
+      char *end = nullptr;
+      cpu_percent = strtod(percent.c_str(), &end);
+      if (end == percent.c_str() || *end != '\0' || cpu_percent <= 0)
+      {
+        cerr << "limit: invalid cpu percentage '" << args[i + 1] << "'" << endl;
+        return 2;
+      }
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  if (i >= args.size())
+  {
+    cerr << "limit: usage: limit [--mem SIZE] [--cpu PERCENT] command [args...]" << endl;
+    return 2;
+  }
+
+  vector<string> controllers;
+  if (memory)
+    controllers.push_back("memory");
+  if (cpu_percent > 0)
+    controllers.push_back("cpu");
+  string group = create_transient_cgroup(controllers);
+
+  JobControls controls = outer ? *outer : JobControls();
+  JobUsage usage;
+  controls.usage = &usage;
+
+  if (!group.empty())
+  {
+    bool applied = true;
+    if (memory)
+      applied = write_text_file(group + "/memory.max", to_string(memory));
+    if (cpu_percent > 0)
+    {
+      const long period = 100000;
+      long quota = max(1000L, (long)(cpu_percent / 100 * period));
+      applied = applied && write_text_file(group + "/cpu.max", to_string(quota) + " " + to_string(period));
+    }
+    if (!applied)
+    {
+      perror("limit: configuring cgroup failed");
+      remove_transient_cgroup(group);
+      return 1;
+    }
+    controls.cgroup = group;
+  }
+  else
+  {
+    if (memory)
+      controls.rlimits.push_back({RLIMIT_AS, {(rlim_t)memory, (rlim_t)memory}});
+    if (cpu_percent > 0)
+      cerr << "limit: no delegated cgroup v2 subtree, --cpu is not enforced" << endl;
+  }
+
+  vector<string> command(args.begin() + i, args.end());
+  int status = execute_wrapped_command(command, stdout_info, stderr_info, &controls);
+
+  ostringstream report;
+  report << fixed << setprecision(2);
+  if (!group.empty())
+  {
+    string peak = read_text_file(group + "/memory.peak");
+    report << "limit: peak memory " << (peak.empty() ? "n/a" : format_bytes(stoull(peak)));
+    if (memory)
+      report << " of " << format_bytes(memory);
+    report << ", cpu " << cgroup_stat(group + "/cpu.stat", "usage_usec") / 1e6 << "s";
+    if (cpu_percent > 0)
+      report << ", throttled " << cgroup_stat(group + "/cpu.stat", "nr_throttled") << "/"
+             << cgroup_stat(group + "/cpu.stat", "nr_periods") << " periods ("
+             << cgroup_stat(group + "/cpu.stat", "throttled_usec") / 1e6 << "s)";
+    if (memory)
+      report << ", oom kills " << cgroup_stat(group + "/memory.events", "oom_kill");
+  }
+  else
+  {
+    report << "limit: peak rss " << format_bytes(usage.peak_rss_kb * 1024ULL) << ", cpu " << usage.cpu_seconds << "s";
+  }
+  cerr << report.str() << endl;
+  if (!group.empty())
+    remove_transient_cgroup(group);
+  return status;
+#endif
+}
+
+int execute_wrapped_command(const vector<string> &args, RedirectInfo &stdout_info, RedirectInfo &stderr_info,
+                            const JobControls *controls)
+{
+  if (!args.empty() && args[0] == "timeout")
+    return execute_timeout(args, stdout_info, stderr_info, controls);
+  if (!args.empty() && args[0] == "retry")
+    return execute_retry(args, stdout_info, stderr_info, controls);
+  if (!args.empty() && args[0] == "limit")
+    return execute_limit(args, stdout_info, stderr_info, controls);
+  return execute_external_command(args, stdout_info, stderr_info, controls);
+}
+
+// Part of a word as written: literal text, or the name of a variable
+// reference ($NAME, ${NAME}, $1, $?) that is looked up when the command runs
+struct WordPart
+{
+  bool variable;
+  string text;
+};
+
+struct Word
+{
+  vector<WordPart> parts;
+  bool quoted = false; // Quoted words survive expanding to nothing
+};
+
+struct ParsedRedirect
+{
+  bool is_stderr;
+  bool append;
+  Word filename;
+};
+
+struct ParsedCommand
+{
+  vector<Word> words;
+  vector<ParsedRedirect> redirects;
+  bool alias_expanded = false; // Came from an alias value, so its first word is not looked up again
+};
+
+// A command line tokenized once into pipelines joined by ";", "&&" and
+// "||". Variables stay unexpanded so "false; echo $?" sees the status of
+// the command before it.
+struct CommandList
+{
+  vector<vector<ParsedCommand>> pipelines;
+  vector<string> operators; // operators[i] joins pipelines[i] and pipelines[i + 1]
+};
+
+void append_literal(Word &word, char c)
+{
+  if (word.parts.empty() || word.parts.back().variable)
+    word.parts.push_back({false, ""});
+  word.parts.back().text += c;
+}
+
+// Tokenize a whole command line in one pass. Returns false with a message in
+// error for an empty pipeline stage, a dangling operator or a redirection
+// without a filename.
+bool parse_command_line(const string &input, CommandList &list, string &error)
+{
+  list = CommandList();
+  vector<ParsedCommand> pipeline(1);
+  Word word;
+  bool in_word = false;
+  bool redirect_pending = false;
+  bool in_single_quotes = false;
+  bool in_double_quotes = false;
+  bool escaped = false;
+
+  // A finished word names the pending redirection's file, or is an argument
+  auto end_word = [&]()
+  {
+    if (!in_word)
+      return;
+    if (redirect_pending)
+      pipeline.back().redirects.back().filename = word;
+    else
+      pipeline.back().words.push_back(word);
+    word = Word();
+    in_word = false;
+    redirect_pending = false;
+  };
+
+  // Check that the command before an operator is complete
+  auto end_command = [&](const string &token)
+  {
+    end_word();
+    const ParsedCommand &command = pipeline.back();
+    if (redirect_pending || (command.words.empty() && command.redirects.empty()))
+    {
+      error = "syntax error near unexpected token `" + token + "'";
+      return false;
+    }
+    return true;
+  };
+
+  for (size_t i = 0; i < input.size(); ++i)
+  {
+    char c = input[i];
+    char next = i + 1 < input.size() ? input[i + 1] : '\0';
+
+    if (escaped)
+    {
+      if (in_double_quotes && (c != '\\' && c != '$' && c != '"' && c != '\n'))
+        append_literal(word, '\\');
+      append_literal(word, c);
+      escaped = false;
+    }
+    else if (c == '\\' && !in_single_quotes)
+    {
+      escaped = true;
+      in_word = true;
+    }
+    else if (c == '"' && !in_single_quotes)
+    {
+      in_double_quotes = !in_double_quotes;
+      in_word = word.quoted = true;
+    }
+    else if (c == '\'' && !in_double_quotes)
+    {
+      in_single_quotes = !in_single_quotes;
+      in_word = word.quoted = true;
+    }
+    else if (c == '$' && !in_single_quotes &&
+             (isalnum((unsigned char)next) || next == '_' || next == '{' || next == '@' || next == '#' || next == '?'))
+    {
+      size_t start = i + 1;
+      size_t end = start + 1;
+      string name;
+      if (next == '{')
+      {
+        end = input.find('}', start);
+        if (end == string::npos)
+          end = input.size();
+        name = input.substr(start + 1, end - start - 1);
+        end++;
+      }
+      else
+      {
+        if (isalpha((unsigned char)next) || next == '_')
+          while (end < input.size() && (isalnum((unsigned char)input[end]) || input[end] == '_'))
+            end++;
+        name = input.substr(start, end - start);
+      }
+      word.parts.push_back({true, name});
+      in_word = true;
+      i = end - 1;
+    }
+    else if (in_single_quotes || in_double_quotes)
+    {
+      append_literal(word, c);
+    }
+    else if (c == ' ' || c == '\t')
+    {
+      end_word();
+    }
+    else if (c == '|' && next != '|')
+    {
+      if (!end_command("|"))
+        return false;
+      pipeline.emplace_back();
+    }
+    else if (c == ';' || (c == '&' && next == '&') || (c == '|' && next == '|'))
+    {
+      string token = c == ';' ? ";" : string(2, c);
+      if (!end_command(token))
+        return false;
+      list.pipelines.push_back(move(pipeline));
+      list.operators.push_back(token);
+      pipeline.assign(1, ParsedCommand());
+      i += token.size() - 1;
+    }
+    else if (c == '>' || ((c == '1' || c == '2') && !in_word && next == '>'))
+    {
+      end_word();
+      if (redirect_pending)
+      {
+        error = "syntax error near unexpected token `>'";
+        return false;
+      }
+      bool is_stderr = c == '2';
+      if (c != '>')
+        i++;
+      bool append = i + 1 < input.size() && input[i + 1] == '>';
+      if (append)
+        i++;
+      // Repeated redirections accumulate instead of replacing (multios)
+      pipeline.back().redirects.push_back({is_stderr, append, Word()});
+      redirect_pending = true;
+    }
+    else
+    {
+      append_literal(word, c);
+      in_word = true;
+    }
+  }
+
+  end_word();
+  if (redirect_pending)
+  {
+    error = "syntax error near unexpected token `newline'";
+    return false;
+  }
+
+  const ParsedCommand &last = pipeline.back();
+  if (last.words.empty() && last.redirects.empty())
+  {
+    // Only a trailing ";" may end a line without a command after it
+    if (pipeline.size() > 1 || (!list.operators.empty() && list.operators.back() != ";"))
+    {
+      error = "syntax error near unexpected token `" + (pipeline.size() > 1 ? string("|") : list.operators.back()) + "'";
+      return false;
+    }
+    if (!list.operators.empty())
+      list.operators.pop_back();
+    return true;
+  }
+
+  list.pipelines.push_back(move(pipeline));
+  return true;
+}
+
+// Text of a word with its variable references looked up now
+string expand_word(const Word &word)
+{
+  string text;
+  for (const WordPart &part : word.parts)
+    text += part.variable ? lookup_variable(part.text) : part.text;
+  return text;
+}
+
+// Arguments and redirection targets of a parsed command. An unquoted word
+// that expands to nothing is dropped.
+Command expand_command(const ParsedCommand &parsed)
+{
+  Command command;
+  for (const Word &word : parsed.words)
+  {
+    string text = expand_word(word);
+    if (!text.empty() || word.quoted)
+      command.args.push_back(text);
+  }
+  for (const ParsedRedirect &redirect : parsed.redirects)
+  {
+    RedirectInfo &info = redirect.is_stderr ? command.stderr_info : command.stdout_info;
+    info.targets.push_back({expand_word(redirect.filename), redirect.append, 0});
+  }
+  return command;
+}
+
+// Number of leading bytes two ranges have in common, compared 16 at a time
+size_t common_prefix_length(const char *a, const char *b, size_t n)
+{
+  size_t i = 0;
+#if defined(__SSE2__) && defined(__GNUC__)
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+    unsigned equal = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+    if (equal != 0xFFFF)
+      return i + __builtin_ctz(~equal);
+  }
+#endif
+  while (i < n && a[i] == b[i])
+    i++;
+  return i;
+}
+
+// Function to find the longest common prefix of a vector of strings
+string find_longest_common_prefix(const vector<string> &matches)
+{
+  if (matches.empty())
+  {
+    return "";
+  }
+
+  // Shrink a length instead of reassigning a substring for every match
+  size_t length = matches[0].length();
+  for (size_t i = 1; i < matches.size() && length > 0; ++i)
+  {
+    length = common_prefix_length(matches[0].data(), matches[i].data(), min(length, matches[i].length()));
+  }
+
+  return matches[0].substr(0, length);
+}
+
+// Completion candidates packed back to back into one contiguous buffer, so
+// filtering is a linear scan that never allocates per candidate
+struct CandidateSet
+{
+  string buffer;
+  vector<uint32_t> offsets;
+  vector<uint32_t> lengths;
+};
+
+void add_candidate(CandidateSet &set, const char *name, size_t length)
+{
+  set.offsets.push_back(set.buffer.size());
+  set.lengths.push_back(length);
+  set.buffer.append(name, length);
+}
+
+string_view candidate_at(const CandidateSet &set, size_t i)
+{
+  return string_view(set.buffer.data() + set.offsets[i], set.lengths[i]);
+}
+
+// Indices of every candidate starting with prefix. Short prefixes are checked
+// with a single masked 16-byte compare per candidate.
+vector<uint32_t> match_prefix(const CandidateSet &set, string_view prefix)
+{
+  vector<uint32_t> matches;
+  const char *data = set.buffer.data();
+  size_t size = set.buffer.size();
+
+#if defined(__SSE2__) && defined(__GNUC__)
+  if (prefix.length() <= 16)
+  {
+    char pattern_bytes[16] = {};
+    memcpy(pattern_bytes, prefix.data(), prefix.length());
+    __m128i pattern = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pattern_bytes));
+    unsigned mask = (1u << prefix.length()) - 1;
+
+    for (size_t i = 0; i < set.offsets.size(); ++i)
+    {
+      if (set.lengths[i] < prefix.length())
+        continue;
+      const char *name = data + set.offsets[i];
+      if (set.offsets[i] + 16 <= size)
+      {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(name));
+        if ((_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, pattern)) & mask) == mask)
+          matches.push_back(i);
+      }
+      else if (memcmp(name, prefix.data(), prefix.length()) == 0)
+      {
+        matches.push_back(i);
+      }
+    }
+    return matches;
+  }
+#endif
+
+  for (size_t i = 0; i < set.offsets.size(); ++i)
+  {
+    if (set.lengths[i] >= prefix.length() &&
+        common_prefix_length(data + set.offsets[i], prefix.data(), prefix.length()) == prefix.length())
+      matches.push_back(i);
+  }
+  return matches;
+}
+
+// Score pattern as a subsequence of name, or -1 if it is not one. Matches at
+// the start, after a separator, and in consecutive runs rank higher.
+int fuzzy_score(string_view name, string_view pattern)
+{
+  int score = 0;
+  size_t j = 0;
+  size_t last = string_view::npos;
+
+  for (size_t i = 0; i < name.length() && j < pattern.length(); ++i)
+  {
+    if (name[i] != pattern[j])
+      continue;
+
+    score += 1;
+    if (i == 0)
+      score += 10;
+    else if (name[i - 1] == '-' || name[i - 1] == '_' || name[i - 1] == '.')
+      score += 8;
+    if (last != string_view::npos && last + 1 == i)
+      score += 5;
+    last = i;
+    j++;
+  }
+
+  if (j < pattern.length())
+    return -1;
+  return score * 4 - (int)(name.length() - pattern.length());
+}
+
+// Indices of every candidate containing pattern as a subsequence, best first
+vector<uint32_t> match_fuzzy(const CandidateSet &set, string_view pattern)
+{
+  vector<pair<int, uint32_t>> scored;
+  for (size_t i = 0; i < set.offsets.size(); ++i)
+  {
+    if (set.lengths[i] < pattern.length())
+      continue;
+    int score = fuzzy_score(candidate_at(set, i), pattern);
+    if (score >= 0)
+      scored.push_back({score, (uint32_t)i});
+  }
+
+  stable_sort(scored.begin(), scored.end(), [&](const pair<int, uint32_t> &a, const pair<int, uint32_t> &b)
+              { return a.first != b.first ? a.first > b.first : candidate_at(set, a.second) < candidate_at(set, b.second); });
+
+  vector<uint32_t> matches;
+  for (const auto &entry : scored)
+    matches.push_back(entry.second);
+  return matches;
+}
+
+// Every file name found in PATH. The directories are only rescanned when PATH
+// or one of their modification times changes, and the executable bit is
+// looked up lazily for names that actually match.
+struct PathCandidates
+{
+  string path;
+  vector<string> dirs;
+  vector<long long> dir_mtimes;
+  CandidateSet names;
+  vector<uint16_t> name_dirs;   // Index into dirs for every name
+  vector<int8_t> is_executable; // -1 until checked
+};
+
+void refresh_path_candidates(PathCandidates &cache)
+{
+  char *path_env = getenv("PATH");
+  string path = path_env ? path_env : "";
+
+  bool stale = path != cache.path;
+  vector<string> dirs;
+  vector<long long> mtimes;
+  stringstream ss(path);
+  string dir;
+  while (getline(ss, dir, ':'))
+  {
+    struct stat buffer;
+    dirs.push_back(dir);
+    mtimes.push_back(stat(dir.c_str(), &buffer) == 0 ? modification_time(buffer) : -1);
+  }
+  stale = stale || mtimes != cache.dir_mtimes;
+  if (!stale)
+    return;
+
+  cache = PathCandidates();
+  cache.path = path;
+  cache.dirs = dirs;
+  cache.dir_mtimes = mtimes;
+
+  for (size_t d = 0; d < dirs.size(); ++d)
+  {
+#ifdef _WIN32
+    WIN32_FIND_DATAA findData;
+    string search_path = dirs[d] + "\\*";
+    HANDLE hFind = FindFirstFileA(search_path.c_str(), &findData);
+
+    if (hFind != INVALID_HANDLE_VALUE)
+    {
+      do
+      {
+        add_candidate(cache.names, findData.cFileName, strlen(findData.cFileName));
+        cache.name_dirs.push_back(d);
+      } while (FindNextFileA(hFind, &findData));
+
+      FindClose(hFind);
+    }
+#else
+    DIR *dp = opendir(dirs[d].c_str());
+    if (dp != NULL)
+    {
+      struct dirent *entry;
+      while ((entry = readdir(dp)) != NULL)
+      {
+        if (entry->d_type == DT_DIR)
+          continue;
+        add_candidate(cache.names, entry->d_name, strlen(entry->d_name));
+        cache.name_dirs.push_back(d);
+      }
+      closedir(dp);
+    }
+#endif
+  }
+  cache.is_executable.assign(cache.names.offsets.size(), -1);
+}
+
+bool path_candidate_executable(PathCandidates &cache, uint32_t i)
+{
+  if (cache.is_executable[i] == -1)
+  {
+    string full_path = cache.dirs[cache.name_dirs[i]] + "/" + string(candidate_at(cache.names, i));
+#ifdef _WIN32
+    cache.is_executable[i] = GetFileAttributesA(full_path.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+    struct stat buffer;
+    cache.is_executable[i] = stat(full_path.c_str(), &buffer) == 0 && S_ISREG(buffer.st_mode) &&
+                             (buffer.st_mode & S_IXUSR);
+#endif
+  }
+  return cache.is_executable[i] == 1;
+}
+
+// Set by the compmode builtin; fuzzy completion kicks in when no name has
+// the typed text as a prefix
+bool fuzzy_completion = false;
+
+// Enhanced function to handle tab completion for builtin commands and executables in PATH
+// Modified to return all matches instead of just one, sorted alphabetically
+// with duplicates removed (fuzzy matches, tried only when nothing matches by
+// prefix, are returned best first instead)
+vector<string> complete_command(const string &partial_cmd)
+{
+  vector<string> matches;
+
+  // Builtins, aliases and functions the shell knows right now
+  auto add_shell_name = [&](const string &cmd)
+  {
+    if (cmd.compare(0, partial_cmd.length(), partial_cmd) == 0)
+      matches.push_back(cmd);
+  };
+  for (const auto &cmd : shell.builtins)
+    add_shell_name(cmd);
+  for (const auto &alias : shell.aliases)
+    add_shell_name(alias.first);
+  for (const auto &function : shell.functions)
+    add_shell_name(function.first);
+
+  // Search for executables in PATH alongside them
+  static PathCandidates cache;
+  refresh_path_candidates(cache);
+
+  vector<uint32_t> found = match_prefix(cache.names, partial_cmd);
+  bool fuzzy = found.empty() && matches.empty() && fuzzy_completion;
+  if (fuzzy)
+    found = match_fuzzy(cache.names, partial_cmd);
+
+  unordered_set<string_view> seen;
+  for (uint32_t i : found)
+  {
+    string_view name = candidate_at(cache.names, i);
+    if (path_candidate_executable(cache, i) && seen.insert(name).second)
+      matches.emplace_back(name);
+  }
+
+  // Sort matches alphabetically; a builtin may share its name with a program
+  if (!fuzzy)
+  {
+    sort(matches.begin(), matches.end());
+    matches.erase(unique(matches.begin(), matches.end()), matches.end());
+  }
+  return matches;
+}
+
+string get_input_with_completion()
+{
+  string input;
+  size_t cursor_pos = 0;
+  bool tab_pressed_once = false;
+  vector<string> previous_matches;
+
+#ifdef _WIN32
+  cout << "$ " << flush;
+
+  while (true)
+  {
+    int c = _getch();
+
+    if (c == 13)
+    { // Enter key
+      cout << endl;
+      break;
+    }
+    else if (c == 8 || c == 127)
+    { // Backspace
+      if (cursor_pos > 0)
+      {
+        input.erase(cursor_pos - 1, 1);
+        cursor_pos--;
+        cout << "\b \b" << flush;
+        tab_pressed_once = false;
+      }
+    }
+    else if (c == 9)
+    { // Tab key
+      if (cursor_pos > 0 && input.find(' ') == string::npos)
+      {
+        string partial_cmd = input.substr(0, cursor_pos);
+        vector<string> matches = complete_command(partial_cmd);
+
+        if (matches.empty())
+        {
+          cout << '\a' << flush;
+          tab_pressed_once = false;
+        }
+        else
+        {
+          string common_prefix = find_longest_common_prefix(matches);
+
+          if (common_prefix.length() > partial_cmd.length())
+          {
+            for (size_t i = 0; i < cursor_pos; i++)
+            {
+              cout << "\b \b" << flush;
+            }
+
+            input = common_prefix + input.substr(cursor_pos);
+            cursor_pos = common_prefix.length();
+            cout << input.substr(0, cursor_pos) << flush;
+
+            // FIX: Only add space if this is the **only match**
+            if (matches.size() == 1)
+            {
+              input += " ";
+              cursor_pos++;
+              cout << " " << flush;
+            }
+
+            tab_pressed_once = false;
+          }
+          else if (!tab_pressed_once)
+          {
+            cout << '\a' << flush;
+            tab_pressed_once = true;
+            previous_matches = matches;
+          }
+          else
+          {
+            cout << endl;
+            for (const auto &match : matches)
+            {
+              cout << match << "  ";
+            }
+            cout << endl
+                 << "$ " << input.substr(0, cursor_pos) << flush;
+            tab_pressed_once = false;
+          }
+        }
+      }
+      else
+      {
+        tab_pressed_once = false;
+      }
+    }
+    else if (c >= 32 && c < 127)
+    {
+      input.insert(cursor_pos, 1, static_cast<char>(c));
+      cursor_pos++;
+      cout << static_cast<char>(c) << flush;
+      tab_pressed_once = false;
+    }
+  }
+#else
+  terminal_raw();
+  drain_prompt_wakeups();
 
-  stringstream ss(path_env);
-  string dir;
+  // Echo is collected here and written once per chunk of input, so a burst
+  // of typeahead costs one write instead of a flush per character
+  string prompt_text = render_prompt();
+  string out = prompt_text;
+  bool in_paste = false;
+  string paste;
 
-  while (getline(ss, dir, ':'))
+  // The prompt and input may wrap over several rows. cursor_row is the row,
+  // counted from the prompt's first, that the terminal cursor is on. After
+  // printing exactly a full row the cursor stays on its last column until
+  // the next character, so that row still counts as current.
+  size_t columns = terminal_columns();
+  auto row_after = [&](size_t cells)
+  { return cells > 0 && cells % columns == 0 ? cells / columns - 1 : cells / columns; };
+  auto line_width = [&]()
+  { return display_width(prompt_text) + display_width(input); };
+  size_t cursor_row = row_after(display_width(prompt_text));
+
+  // Redraw in place: back up to the prompt's first row, print everything,
+  // clear what is left of a longer previous line, then place the cursor
+  auto redraw = [&]()
+  {
+    columns = terminal_columns();
+    if (cursor_row > 0)
+      out += "\033[" + to_string(cursor_row) + "A";
+    out += "\r" + prompt_text + input;
+
+    size_t total = line_width();
+    if (total > 0 && total % columns == 0)
+      out += "\r\n"; // Leave the pending wrap so the cursor can move up
+    out += "\033[J";
+
+    size_t target = display_width(prompt_text) + display_width(input, cursor_pos);
+    size_t row = total / columns;
+    cursor_row = target / columns;
+    if (row > cursor_row)
+      out += "\033[" + to_string(row - cursor_row) + "A";
+    out += "\r";
+    if (target % columns > 0)
+      out += "\033[" + to_string(target % columns) + "C";
+  };
+
+  // Start a new line below the input, e.g. to submit it or list matches
+  auto newline_below = [&]()
+  {
+    size_t saved = cursor_pos;
+    if (cursor_pos < input.size())
+    {
+      cursor_pos = input.size();
+      redraw();
+      cursor_pos = saved;
+    }
+    out += "\n";
+    cursor_row = 0;
+  };
+
+  auto insert_text = [&](const string &text)
+  {
+    input.insert(cursor_pos, text);
+    cursor_pos += text.size();
+    if (cursor_pos == input.size())
+    {
+      // Appending lets the terminal wrap on its own
+      out += text;
+      cursor_row = row_after(line_width());
+    }
+    else
+    {
+      redraw();
+    }
+    tab_pressed_once = false;
+  };
+
+  string &pending = terminal.pending;
+  size_t i = 0;
+  bool done = false;
+
+  while (!done)
+  {
+    if (!out.empty())
+    {
+      cout << out << flush;
+      out.clear();
+    }
+
+    pending.erase(0, i);
+    i = 0;
+    if (pending.empty() && !terminal_fill(-1))
+    {
+      // End of input: hand back whatever was typed, then report EOF
+      cout << endl;
+      break;
+    }
+
+    // Redraw in place with the fresher prompt, keeping the typed input
+    if (terminal.prompt_changed)
+    {
+      terminal.prompt_changed = false;
+      prompt_text = render_prompt();
+      redraw();
+    }
+
+    bool need_more = false;
+    while (i < pending.size() && !done && !need_more)
+    {
+      if (in_paste)
+      {
+        // Pasted text is inserted in one operation once the closing
+        // ESC [ 201 ~ arrives; keep a possibly split terminator pending
+        size_t end = pending.find("\033[201~", i);
+        if (end == string::npos)
+        {
+          size_t keep = min<size_t>(5, pending.size() - i);
+          paste.append(pending, i, pending.size() - i - keep);
+          i = pending.size() - keep;
+          need_more = true;
+          continue;
+        }
+
+        paste.append(pending, i, end - i);
+        i = end + 6;
+        in_paste = false;
+
+        // A multi-line paste runs line by line: the first line is entered
+        // now and the rest stays queued as a paste for the next prompts
+        size_t line_end = paste.find_first_of("\r\n");
+        if (line_end != string::npos)
+        {
+          size_t rest = line_end + 1;
+          if (paste[line_end] == '\r' && rest < paste.size() && paste[rest] == '\n')
+            rest++;
+          if (rest < paste.size())
+            pending.insert(i, "\033[200~" + paste.substr(rest) + "\033[201~");
+          paste.resize(line_end);
+        }
+
+        string text;
+        for (char p : paste)
+        {
+          if (p == '\t')
+            text += ' ';
+          else if ((unsigned char)p >= 32 && p != 127)
+            text += p;
+        }
+        paste.clear();
+        if (!text.empty())
+          insert_text(text);
+        if (line_end != string::npos)
+        {
+          newline_below();
+          done = true;
+        }
+        continue;
+      }
+
+      char c = pending[i];
+
+      if (c == '\033')
+      {
+        // A lone ESC is only told apart from a sequence by what follows it
+        if (i + 1 >= pending.size() && terminal_fill(50))
+          continue;
+        if (i + 1 >= pending.size())
+        {
+          i++;
+          continue;
+        }
+
+        if (pending[i + 1] != '[' && pending[i + 1] != 'O')
+        {
+          i += 2; // Alt+key, ignored
+          continue;
+        }
+
+        size_t end = i + 2;
+        while (end < pending.size() && !(pending[end] >= 0x40 && pending[end] <= 0x7E))
+          end++;
+        if (end >= pending.size())
+        {
+          need_more = true;
+          continue;
+        }
+
+        string params = pending.substr(i + 2, end - i - 2);
+        char final_byte = pending[end];
+        i = end + 1;
+
+        if (final_byte == '~' && params == "200")
+          in_paste = true;
+        else if (final_byte == 'D' && cursor_pos > 0)
+        {
+          cursor_pos--;
+          if (line_width() < columns)
+            out += "\033[D";
+          else
+            redraw();
+        }
+        else if (final_byte == 'C' && cursor_pos < input.size())
+        {
+          cursor_pos++;
+          if (line_width() < columns)
+            out += "\033[C";
+          else
+            redraw();
+        }
+        else if (final_byte == 'H' || (final_byte == '~' && (params == "1" || params == "7")))
+        {
+          cursor_pos = 0;
+          redraw();
+        }
+        else if (final_byte == 'F' || (final_byte == '~' && (params == "4" || params == "8")))
+        {
+          cursor_pos = input.size();
+          redraw();
+        }
+        else if (final_byte == '~' && params == "3" && cursor_pos < input.size())
+        {
+          input.erase(cursor_pos, 1);
+          redraw();
+        }
+        continue;
+      }
+
+      i++;
+
+      if (c == '\n')
+      {
+        newline_below();
+        done = true;
+      }
+      else if (c == 127 || c == 8)
+      {
+        if (cursor_pos > 0)
+        {
+          // Backspace at the end only works away from a row's first column
+          bool at_end = cursor_pos == input.size() && line_width() % columns != 0;
+          input.erase(cursor_pos - 1, 1);
+          cursor_pos--;
+          if (at_end)
+            out += "\b \b";
+          else
+            redraw();
+          tab_pressed_once = false;
+        }
+      }
+      else if (c == 9)
+      {
+        if (cursor_pos > 0 && input.find(' ') == string::npos)
+        {
+          string partial_cmd = input.substr(0, cursor_pos);
+          vector<string> matches = complete_command(partial_cmd);
+
+          if (matches.empty())
+          {
+            out += '\a';
+            tab_pressed_once = false;
+          }
+          else
+          {
+            string common_prefix = find_longest_common_prefix(matches);
+
+            if (common_prefix.length() > partial_cmd.length())
+            {
+              input = common_prefix + input.substr(cursor_pos);
+              cursor_pos = common_prefix.length();
+
+              // FIX: Only add space if this is the **only match**
+              if (matches.size() == 1)
+              {
+                input.insert(cursor_pos, " ");
+                cursor_pos++;
+              }
+              redraw();
+
+              tab_pressed_once = false;
+            }
+            else if (!tab_pressed_once)
+            {
+              out += '\a';
+              tab_pressed_once = true;
+              previous_matches = matches;
+            }
+            else
+            {
+              newline_below();
+              for (const auto &match : matches)
+              {
+                out += match + "  ";
+              }
+              out += "\n";
+              redraw();
+              tab_pressed_once = false;
+            }
+          }
+        }
+        else
+        {
+          tab_pressed_once = false;
+        }
+      }
+      else if (c >= 32 && c < 127)
+      {
+        // Runs of plain characters are inserted together
+        size_t run = i;
+        while (run < pending.size() && pending[run] >= 32 && pending[run] < 127)
+          run++;
+        insert_text(pending.substr(i - 1, run - i + 1));
+        i = run;
+      }
+    }
+
+    if (need_more && !terminal_fill(-1))
+    {
+      cout << out << endl;
+      out.clear();
+      break;
+    }
+  }
+
+  if (!out.empty())
+    cout << out << flush;
+  pending.erase(0, i);
+#endif
+
+  return input;
+}
+
+// Function to execute cd command
+
+// Function to execute cd command
+#include <iostream>
+#include <unistd.h> // For chdir() and getcwd()
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <unordered_set>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <limits.h> // For PATH_MAX in POSIX systems
+#include <cstdlib>  // For getenv()
+
+using namespace std;
+
+// Function to execute cd command
+int execute_cd(const std::string &path)
+{
+  std::string final_path = path;
+
+  // If the path starts with '~', replace it with the HOME environment variable
+  if (path[0] == '~')
+  {
+    const char *home = getenv("HOME");
+    if (home)
+    {
+      final_path = home + std::string(path.substr(1)); // Replace ~ with HOME
+    }
+    else
+    {
+      std::cerr << "cd: HOME not set" << std::endl;
+      return 1;
+    }
+  }
+
+#ifdef _WIN32
+  if (_chdir(final_path.c_str()) == -1)
+  { // For Windows
+    std::cerr << "cd: " << final_path << ": No such file or directory" << std::endl;
+    return 1;
+  }
+#else
+  if (chdir(final_path.c_str()) == -1)
+  { // For Unix-like systems
+    std::cerr << "cd: " << final_path << ": No such file or directory" << std::endl;
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+// Existing function for pwd
+int execute_builtin_pwd()
+{
+  char cwd[PATH_MAX]; // Use PATH_MAX for POSIX systems
+  if (getcwd(cwd, sizeof(cwd)) != NULL)
+  { // POSIX alternative to _getcwd()
+    cout << cwd << endl;
+    return 0;
+  }
+  perror("pwd");
+  return 1;
+}
+
+// Remember the per-target byte counters of a command that redirected output
+void record_redirect_stats(const RedirectInfo &stdout_info, const RedirectInfo &stderr_info,
+                           RedirectInfo &last_stdout_info, RedirectInfo &last_stderr_info)
+{
+  if (stdout_info.targets.empty() && stderr_info.targets.empty())
+    return;
+  last_stdout_info = stdout_info;
+  last_stderr_info = stderr_info;
+}
+
+// Builtin redirstat: report how many bytes each redirection target received
+void print_redirect_stats(const RedirectInfo &last_stdout_info, const RedirectInfo &last_stderr_info)
+{
+  if (last_stdout_info.targets.empty() && last_stderr_info.targets.empty())
+  {
+    cout << "redirstat: no redirections yet" << endl;
+    return;
+  }
+  for (const RedirectTarget &target : last_stdout_info.targets)
+  {
+    cout << (target.append ? "1>> " : "1> ") << target.filename << ": " << target.bytes_written << " bytes" << endl;
+  }
+  for (const RedirectTarget &target : last_stderr_info.targets)
+  {
+    cout << (target.append ? "2>> " : "2> ") << target.filename << ": " << target.bytes_written << " bytes" << endl;
+  }
+}
+
+// Builtin pstat: toggle pipeline monitoring or report the last monitored pipeline
+void execute_pstat(const vector<string> &args, bool &monitoring, const PipelineStats &stats)
+{
+  if (args.size() > 1)
+  {
+    if (args[1] == "on")
+      monitoring = true;
+    else if (args[1] == "off")
+      monitoring = false;
+    else
+      cerr << "pstat: usage: pstat [on|off]" << endl;
+    return;
+  }
+
+  if (stats.stages.empty())
+  {
+    cout << "pstat: no monitored pipeline yet" << (monitoring ? "" : " (enable with 'pstat on')") << endl;
+    return;
+  }
+
+  // A stage the relays kept waiting on is the likely bottleneck
+  vector<double> waited_on(stats.stages.size(), 0);
+  streamsize precision = cout.precision();
+  cout << fixed << setprecision(2);
+  for (size_t i = 0; i < stats.links.size(); ++i)
+  {
+    const PipeLinkStats &link = stats.links[i];
+    double samples = link.samples ? link.samples : 1;
+    double mib = link.bytes / (1024.0 * 1024.0);
+    waited_on[i] += link.producer_wait_seconds;
+    waited_on[i + 1] += link.consumer_wait_seconds;
+
+    cout << stats.stages[i] << " -> " << stats.stages[i + 1] << ": " << link.bytes << " bytes, "
+         << (stats.seconds > 0 ? mib / stats.seconds : 0) << " MiB/s" << endl;
+    cout << "  pipe fill avg " << (int)(100 * link.upstream_fill / samples) << "% in / "
+         << (int)(100 * link.downstream_fill / samples) << "% out, waited " << link.producer_wait_seconds << "s ("
+         << link.producer_waits << "x) on " << stats.stages[i] << ", " << link.consumer_wait_seconds << "s ("
+         << link.consumer_waits << "x) on " << stats.stages[i + 1] << endl;
+  }
+
+  size_t bottleneck = max_element(waited_on.begin(), waited_on.end()) - waited_on.begin();
+  cout << "total " << stats.seconds << "s";
+  if (waited_on[bottleneck] > 0)
+    cout << ", likely bottleneck: " << stats.stages[bottleneck];
+  cout << endl
+       << defaultfloat << setprecision(precision);
+}
+
+// Letters, digits and underscores, not starting with a digit
+bool valid_variable_name(const string &name)
+{
+  if (name.empty() || isdigit((unsigned char)name[0]))
+    return false;
+  for (char c : name)
+  {
+    if (!isalnum((unsigned char)c) && c != '_')
+      return false;
+  }
+  return true;
+}
+
+// NAME=value, where NAME is a valid variable name
+bool split_assignment(const string &word, string &name, string &value)
+{
+  size_t equals = word.find('=');
+  if (equals == string::npos || !valid_variable_name(word.substr(0, equals)))
+    return false;
+  name = word.substr(0, equals);
+  value = word.substr(equals + 1);
+  return true;
+}
+
+// Recognize "name() {" or a one-line "name() { body }"; body is left empty
+// for the multi-line form
+bool parse_function_header(const string &line, string &name, string &body, bool &one_line)
+{
+  size_t parens = line.find("()");
+  if (parens == string::npos || parens == 0)
+    return false;
+
+  name = line.substr(0, parens);
+  for (char c : name)
+  {
+    if (!isalnum((unsigned char)c) && c != '_' && c != '-')
+      return false;
+  }
+
+  size_t brace = line.find_first_not_of(' ', parens + 2);
+  if (brace == string::npos || line[brace] != '{')
+    return false;
+
+  string rest = line.substr(brace + 1);
+  size_t close = rest.find_last_not_of(' ');
+  one_line = close != string::npos && rest[close] == '}';
+  body = one_line ? rest.substr(0, close) : "";
+  size_t first = body.find_first_not_of(' ');
+  body = first == string::npos ? "" : body.substr(first, body.find_last_not_of(' ') - first + 1);
+  return true;
+}
+
+// Replace each unquoted first word naming an alias in list.pipelines[index]
+// with the alias value's parsed commands, as if the value had been typed in
+// its place: stages before it join the value's first pipeline, and the rest
+// of the command and the stages after it join the value's last one. Returns
+// false with a message in error if an alias value does not parse.
+bool expand_aliases(CommandList &list, size_t index, string &error)
+{
+  for (size_t k = 0; k < list.pipelines[index].size(); ++k)
+  {
+    vector<ParsedCommand> &pipeline = list.pipelines[index];
+    ParsedCommand &parsed = pipeline[k];
+    if (parsed.alias_expanded || parsed.words.empty() || parsed.words[0].quoted ||
+        parsed.words[0].parts.size() != 1 || parsed.words[0].parts[0].variable)
+      continue;
+
+    auto alias = shell.aliases.find(parsed.words[0].parts[0].text);
+    if (alias == shell.aliases.end())
+      continue;
+
+    CommandList value;
+    if (!parse_command_line(alias->second, value, error))
+    {
+      error = alias->first + ": " + error;
+      return false;
+    }
+    parsed.words.erase(parsed.words.begin());
+    parsed.alias_expanded = true;
+    if (value.pipelines.empty())
+      continue;
+
+    for (vector<ParsedCommand> &stages : value.pipelines)
+      for (ParsedCommand &stage : stages)
+        stage.alias_expanded = true;
+    ParsedCommand &last = value.pipelines.back().back();
+    last.words.insert(last.words.end(), parsed.words.begin(), parsed.words.end());
+    last.redirects.insert(last.redirects.end(), parsed.redirects.begin(), parsed.redirects.end());
+    value.pipelines.front().insert(value.pipelines.front().begin(), pipeline.begin(), pipeline.begin() + k);
+    value.pipelines.back().insert(value.pipelines.back().end(), pipeline.begin() + k + 1, pipeline.end());
+
+    // Stages after the alias now sit in the last spliced pipeline; when that
+    // is this one, rescanning from the start reaches them
+    list.operators.insert(list.operators.begin() + index, value.operators.begin(), value.operators.end());
+    list.pipelines.erase(list.pipelines.begin() + index);
+    list.pipelines.insert(list.pipelines.begin() + index, value.pipelines.begin(), value.pipelines.end());
+    k = (size_t)-1;
+  }
+  return true;
+}
+
+// Builtin alias: alias [name[=value] ...]
+int execute_alias(const vector<string> &args)
+{
+  if (args.size() == 1)
   {
-#ifdef _WIN32
-    WIN32_FIND_DATAA findData;
-    string search_path = dir + "\\*";
-    HANDLE hFind = FindFirstFileA(search_path.c_str(), &findData);
+    for (const auto &alias : shell.aliases)
+      cout << "alias " << alias.first << "='" << alias.second << "'" << endl;
+    return 0;
+  }
 
-    if (hFind != INVALID_HANDLE_VALUE)
+  int status = 0;
+  for (size_t i = 1; i < args.size(); ++i)
+  {
+    size_t equals = args[i].find('=');
+    if (equals != string::npos)
     {
-      do
-      {
-        string filename = findData.cFileName;
-        if (filename.substr(0, partial_cmd.length()) == partial_cmd)
-        {
-          // Check if the file is executable
-          string full_path = dir + "\\" + filename;
-          if (GetFileAttributesA(full_path.c_str()) != INVALID_FILE_ATTRIBUTES)
-          {
-            matches.push_back(filename);
-          }
-        }
-      } while (FindNextFileA(hFind, &findData));
+      shell.aliases[args[i].substr(0, equals)] = args[i].substr(equals + 1);
+      continue;
+    }
 
-      FindClose(hFind);
+    auto alias = shell.aliases.find(args[i]);
+    if (alias == shell.aliases.end())
+    {
+      cerr << "alias: " << args[i] << ": not found" << endl;
+      status = 1;
     }
-#else
-    DIR *dp = opendir(dir.c_str());
-    if (dp != NULL)
+    else
     {
-      struct dirent *entry;
-      while ((entry = readdir(dp)) != NULL)
+      cout << "alias " << alias->first << "='" << alias->second << "'" << endl;
+    }
+  }
+  return status;
+}
+
+// Builtin export: export NAME[=value] ... moves variables into the environment
+int execute_export(const vector<string> &args)
+{
+  int status = 0;
+  for (size_t i = 1; i < args.size(); ++i)
+  {
+    string name, value;
+    if (!split_assignment(args[i], name, value))
+    {
+      if (!valid_variable_name(args[i]))
       {
-        string filename = entry->d_name;
-        if (filename.substr(0, partial_cmd.length()) == partial_cmd)
-        {
-          // Check if the file is executable
-          string full_path = dir + "/" + filename;
-          struct stat buffer;
-          if (stat(full_path.c_str(), &buffer) == 0 &&
-              (buffer.st_mode & S_IXUSR))
-          {
-            matches.push_back(filename);
-          }
-        }
+        cerr << "export: `" << args[i] << "': not a valid identifier" << endl;
+        status = 1;
+        continue;
       }
-      closedir(dp);
+      name = args[i];
+      auto variable = shell.variables.find(name);
+      value = variable != shell.variables.end() ? variable->second : lookup_variable(name);
     }
+    shell.variables.erase(name);
+#ifdef _WIN32
+    _putenv_s(name.c_str(), value.c_str());
+#else
+    setenv(name.c_str(), value.c_str(), 1);
 #endif
   }
+  return status;
+}
+
+int execute_line(const string &input);
+
+// Run a shell function with its arguments as positional parameters
+int execute_function(const vector<string> &body, const vector<string> &args)
+{
+  if (shell.function_depth >= 100)
+  {
+    cerr << args[0] << ": maximum function nesting level exceeded" << endl;
+    return 1;
+  }
 
-  // Sort matches alphabetically
-  sort(matches.begin(), matches.end());
-  return matches;
+  vector<string> saved = shell.positional;
+  shell.positional.assign(args.begin() + 1, args.end());
+  shell.function_depth++;
+
+  int status = 0;
+  for (const string &line : body)
+  {
+    status = execute_line(line);
+    if (shell.exit_requested)
+      break;
+  }
+
+  shell.function_depth--;
+  shell.positional = saved;
+  return status;
 }
 
-string get_input_with_completion()
+// Builtin exit: exit [N], defaulting to the status of the last command
+int execute_exit(const vector<string> &args)
 {
-  string input;
-  size_t cursor_pos = 0;
-  bool tab_pressed_once = false;
-  vector<string> previous_matches;
+  int code = shell.last_status;
+  if (args.size() > 1)
+  {
+    char *end = nullptr;
+    long value = strtol(args[1].c_str(), &end, 10);
+    if (args[1].empty() || *end != '\0')
+    {
+      cerr << "exit: " << args[1] << ": numeric argument required" << endl;
+      code = 2;
+    }
+    else
+    {
+      code = value & 255;
+    }
+  }
+  shell.exit_requested = true;
+  shell.exit_code = code;
+  return code;
+}
 
-#ifdef _WIN32
-  cout << "$ " << flush;
+// Run one expanded command: an assignment, a function, a builtin or an
+// external program
+int execute_command(Command &command)
+{
+  vector<string> &args = command.args;
+  RedirectInfo &stdout_info = command.stdout_info;
+  RedirectInfo &stderr_info = command.stderr_info;
+  string name, body;
 
-  while (true)
+  if (args.empty())
+    return 0;
+
+  if (args.size() == 1 && split_assignment(args[0], name, body))
   {
-    int c = _getch();
+    if (getenv(name.c_str()))
+      execute_export({"export", args[0]});
+    else
+      shell.variables[name] = body;
+    return 0;
+  }
 
-    if (c == 13)
-    { // Enter key
-      cout << endl;
-      break;
+  auto function = shell.functions.find(args[0]);
+  if (function != shell.functions.end())
+  {
+    return execute_function(function->second, args);
+  }
+
+  if (args[0] == "exit")
+  {
+    return execute_exit(args);
+  }
+
+  if (args[0] == "pwd")
+  {
+    return execute_builtin_pwd();
+  }
+
+  if (args[0] == "echo")
+  {
+    string line;
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+      line += args[i] + (i + 1 < args.size() ? " " : "");
     }
-    else if (c == 8 || c == 127)
-    { // Backspace
-      if (cursor_pos > 0)
-      {
-        input.erase(cursor_pos - 1, 1);
-        cursor_pos--;
-        cout << "\b \b" << flush;
-        tab_pressed_once = false;
-      }
+    line += "\n";
+
+    if (stdout_info.targets.empty())
+    {
+      cout << line;
+    }
+    for (RedirectTarget &target : stdout_info.targets)
+    {
+      ofstream out(target.filename, target.append ? ios::out | ios::app : ios::out);
+      out << line;
+      target.bytes_written = out ? line.size() : 0;
     }
-    else if (c == 9)
-    { // Tab key
-      if (cursor_pos > 0 && input.find(' ') == string::npos)
-      {
-        string partial_cmd = input.substr(0, cursor_pos);
-        vector<string> matches = complete_command(partial_cmd);
 
-        if (matches.empty())
-        {
-          cout << '\a' << flush;
-          tab_pressed_once = false;
-        }
-        else
-        {
-          string common_prefix = find_longest_common_prefix(matches);
+    // echo never writes to stderr, but its targets are still created
+    for (RedirectTarget &target : stderr_info.targets)
+    {
+      ofstream err(target.filename, target.append ? ios::out | ios::app : ios::out);
+    }
 
-          if (common_prefix.length() > partial_cmd.length())
-          {
-            for (size_t i = 0; i < cursor_pos; i++)
-            {
-              cout << "\b \b" << flush;
-            }
+    record_redirect_stats(stdout_info, stderr_info, shell.last_stdout_info, shell.last_stderr_info);
+    return 0;
+  }
 
-            input = common_prefix + input.substr(cursor_pos);
-            cursor_pos = common_prefix.length();
-            cout << input.substr(0, cursor_pos) << flush;
+  if (args[0] == "redirstat")
+  {
+    print_redirect_stats(shell.last_stdout_info, shell.last_stderr_info);
+    return 0;
+  }
 
-            // FIX: Only add space if this is the **only match**
-            if (matches.size() == 1)
-            {
-              input += " ";
-              cursor_pos++;
-              cout << " " << flush;
-            }
+  if (args[0] == "ulimit")
+  {
+    return execute_ulimit(args);
+  }
 
-            tab_pressed_once = false;
-          }
-          else if (!tab_pressed_once)
-          {
-            cout << '\a' << flush;
-            tab_pressed_once = true;
-            previous_matches = matches;
-          }
-          else
-          {
-            cout << endl;
-            for (const auto &match : matches)
-            {
-              cout << match << "  ";
-            }
-            cout << endl
-                 << "$ " << input.substr(0, cursor_pos) << flush;
-            tab_pressed_once = false;
-          }
-        }
+  if (args[0] == "timeout" || args[0] == "retry" || args[0] == "limit")
+  {
+    int status = execute_wrapped_command(args, stdout_info, stderr_info, nullptr);
+    record_redirect_stats(stdout_info, stderr_info, shell.last_stdout_info, shell.last_stderr_info);
+    return status;
+  }
+
+  if (args[0] == "compmode")
+  {
+    if (args.size() < 2)
+      cout << (fuzzy_completion ? "fuzzy" : "prefix") << endl;
+    else if (args[1] == "fuzzy" || args[1] == "prefix")
+      fuzzy_completion = args[1] == "fuzzy";
+    else
+    {
+      cerr << "compmode: usage: compmode [prefix|fuzzy]" << endl;
+      return 2;
+    }
+    return 0;
+  }
+
+  if (args[0] == "pstat")
+  {
+    execute_pstat(args, shell.pipeline_monitoring, shell.last_pipeline_stats);
+    return 0;
+  }
+
+  if (args[0] == "alias")
+  {
+    return execute_alias(args);
+  }
+
+  if (args[0] == "unalias")
+  {
+    for (size_t i = 1; i < args.size(); ++i)
+      shell.aliases.erase(args[i]);
+    return 0;
+  }
+
+  if (args[0] == "export")
+  {
+    return execute_export(args);
+  }
+
+  if (args[0] == "type")
+  {
+    if (args.size() < 2)
+    {
+      cout << "type: missing operand" << endl;
+      return 1;
+    }
+    string cmd = args[1];
+    if (shell.aliases.count(cmd))
+    {
+      cout << cmd << " is aliased to `" << shell.aliases[cmd] << "'" << endl;
+    }
+    else if (shell.functions.count(cmd))
+    {
+      cout << cmd << " is a function" << endl;
+    }
+    else if (shell.builtins.count(cmd))
+    {
+      cout << cmd << " is a shell builtin" << endl;
+    }
+    else
+    {
+      string path = find_in_path(cmd);
+      if (!path.empty())
+      {
+        cout << cmd << " is " << path << endl;
       }
       else
       {
-        tab_pressed_once = false;
+        cout << cmd << ": not found" << endl;
+        return 1;
       }
     }
-    else if (c >= 32 && c < 127)
+    return 0;
+  }
+
+  // Handling 'cd' command
+  if (args[0] == "cd")
+  {
+    if (args.size() < 2)
+    {
+      cerr << "cd: missing operand" << endl;
+      return 1;
+    }
+    else
+    {
+      string path = args[1];
+      return execute_cd(path); // Call the execute_cd function
+    }
+  }
+
+  int status = execute_external_command(args, stdout_info, stderr_info);
+  record_redirect_stats(stdout_info, stderr_info, shell.last_stdout_info, shell.last_stderr_info);
+  return status;
+}
+
+// Run one pipeline of a command list and record the status of each stage
+// in PIPESTATUS
+int execute_parsed_pipeline(const vector<ParsedCommand> &pipeline)
+{
+  if (pipeline.size() == 1)
+  {
+    Command command = expand_command(pipeline[0]);
+    int status = execute_command(command);
+    shell.pipestatus = {status};
+    return status;
+  }
+
+  vector<Command> stages;
+  for (const ParsedCommand &parsed : pipeline)
+  {
+    stages.push_back(expand_command(parsed));
+    if (stages.back().args.empty())
+    {
+      cerr << "syntax error near unexpected token `|'" << endl;
+      shell.pipestatus = {2};
+      return 2;
+    }
+  }
+
+  vector<int> statuses;
+  int status = execute_pipeline(stages, shell.pipeline_monitoring ? &shell.last_pipeline_stats : nullptr,
+                                shell.pipeline_monitoring && isatty(STDERR_FILENO), nullptr, &statuses);
+  if (statuses.empty())
+    statuses.assign(stages.size(), status);
+  shell.pipestatus = statuses;
+
+  RedirectInfo stdout_info;
+  RedirectInfo stderr_info;
+  for (const Command &stage : stages)
+  {
+    stdout_info.targets.insert(stdout_info.targets.end(), stage.stdout_info.targets.begin(), stage.stdout_info.targets.end());
+    stderr_info.targets.insert(stderr_info.targets.end(), stage.stderr_info.targets.begin(), stage.stderr_info.targets.end());
+  }
+  record_redirect_stats(stdout_info, stderr_info, shell.last_stdout_info, shell.last_stderr_info);
+  return status;
+}
+
+// Run one command line: pipelines joined by ";", "&&" and "||", tokenized
+// once up front. Returns the status of the last pipeline that ran, which is
+// also left in $?.
+int execute_line(const string &input)
+{
+  string name, body;
+  bool one_line;
+  if (parse_function_header(input, name, body, one_line))
+  {
+    if (!one_line)
+    {
+      cerr << name << ": multi-line function definitions are only supported in ~/.ownshellrc" << endl;
+      shell.last_status = 2;
+      return 2;
+    }
+    shell.functions[name] = body.empty() ? vector<string>() : vector<string>{body};
+    shell.last_status = 0;
+    return 0;
+  }
+
+  CommandList list;
+  string error;
+  if (!parse_command_line(input, list, error))
+  {
+    cerr << error << endl;
+    shell.last_status = 2;
+    return 2;
+  }
+
+  for (size_t i = 0; i < list.pipelines.size(); ++i)
+  {
+    // Aliases expand when their pipeline is reached, so one defined earlier
+    // on the line applies
+    if (!expand_aliases(list, i, error))
+    {
+      cerr << error << endl;
+      shell.last_status = 2;
+      return 2;
+    }
+
+    // A skipped pipeline leaves $? alone, so "a && b || c" runs c if a or b failed
+    if (i > 0 && ((list.operators[i - 1] == "&&" && shell.last_status != 0) ||
+                  (list.operators[i - 1] == "||" && shell.last_status == 0)))
+      continue;
+
+    shell.last_status = execute_parsed_pipeline(list.pipelines[i]);
+    if (shell.exit_requested)
+      break;
+  }
+  return shell.last_status;
+}
+
+// One line (or multi-line function) of ~/.ownshellrc. Simple definitions
+// are kept pre-tokenized; anything else is a command run at startup.
+struct RcEntry
+{
+  enum Kind : uint8_t
+  {
+    ALIAS,
+    VARIABLE,
+    EXPORT,
+    FUNCTION,
+    COMMAND
+  };
+
+  Kind kind;
+  string name;          // Alias, variable or function name
+  Word value;           // Alias or variable value, expanded when applied
+  vector<string> lines; // Function body, or the command line
+};
+
+// Parsed form of ~/.ownshellrc, applied top to bottom in file order
+struct RcContents
+{
+  vector<RcEntry> entries;
+};
+
+string trim(const string &text)
+{
+  size_t start = text.find_first_not_of(" \t\r");
+  if (start == string::npos)
+    return "";
+  return text.substr(start, text.find_last_not_of(" \t\r") - start + 1);
+}
+
+// NAME=value as written, split into the name and the still unexpanded value
+bool split_word_assignment(const Word &word, string &name, Word &value)
+{
+  string rest;
+  if (word.parts.empty() || word.parts[0].variable || !split_assignment(word.parts[0].text, name, rest))
+    return false;
+
+  value = Word();
+  value.quoted = word.quoted;
+  if (!rest.empty())
+    value.parts.push_back({false, rest});
+  value.parts.insert(value.parts.end(), word.parts.begin() + 1, word.parts.end());
+  return true;
+}
+
+// Turn one rc line into definitions when it is a single simple alias,
+// export or assignment whose every argument defines something
+bool parse_rc_definitions(const string &line, vector<RcEntry> &entries)
+{
+  CommandList list;
+  string error;
+  if (!parse_command_line(line, list, error) || list.pipelines.size() != 1 || list.pipelines[0].size() != 1)
+    return false;
+
+  const ParsedCommand &command = list.pipelines[0][0];
+  if (command.words.empty() || !command.redirects.empty())
+    return false;
+
+  vector<RcEntry> parsed;
+  RcEntry entry;
+  const Word &first = command.words[0];
+  if (command.words.size() == 1 && split_word_assignment(first, entry.name, entry.value))
+  {
+    entry.kind = RcEntry::VARIABLE;
+    parsed.push_back(entry);
+  }
+  else if (!first.quoted && first.parts.size() == 1 && !first.parts[0].variable &&
+           (first.parts[0].text == "alias" || first.parts[0].text == "export") && command.words.size() > 1)
+  {
+    entry.kind = first.parts[0].text == "alias" ? RcEntry::ALIAS : RcEntry::EXPORT;
+    for (size_t i = 1; i < command.words.size(); ++i)
     {
-      input.insert(cursor_pos, 1, static_cast<char>(c));
-      cursor_pos++;
-      cout << static_cast<char>(c) << flush;
-      tab_pressed_once = false;
+      if (!split_word_assignment(command.words[i], entry.name, entry.value))
+        return false;
+      parsed.push_back(entry);
     }
   }
-#else
-  struct termios old_term, new_term;
-  tcgetattr(STDIN_FILENO, &old_term);
-  new_term = old_term;
-  new_term.c_lflag &= ~(ICANON | ECHO);
-  tcsetattr(STDIN_FILENO, TCSANOW, &new_term);
+  else
+  {
+    return false;
+  }
 
-  cout << "$ " << flush;
+  entries.insert(entries.end(), parsed.begin(), parsed.end());
+  return true;
+}
 
-  while (true)
+void parse_rc(const string &text, RcContents &rc)
+{
+  stringstream lines(text);
+  string line;
+  while (getline(lines, line))
   {
-    char c = getchar();
+    line = trim(line);
+    if (line.empty() || line[0] == '#')
+      continue;
 
-    if (c == '\n')
-    {
-      cout << endl;
-      break;
-    }
-    else if (c == 127 || c == 8)
+    RcEntry entry;
+    string body;
+    bool one_line;
+    if (parse_function_header(line, entry.name, body, one_line))
     {
-      if (cursor_pos > 0)
+      if (one_line)
       {
-        input.erase(cursor_pos - 1, 1);
-        cursor_pos--;
-        cout << "\b \b" << flush;
-        tab_pressed_once = false;
+        if (!body.empty())
+          entry.lines.push_back(body);
       }
-    }
-    else if (c == 9)
-    {
-      if (cursor_pos > 0 && input.find(' ') == string::npos)
+      else
       {
-        string partial_cmd = input.substr(0, cursor_pos);
-        vector<string> matches = complete_command(partial_cmd);
-
-        if (matches.empty())
-        {
-          cout << '\a' << flush;
-          tab_pressed_once = false;
-        }
-        else
+        while (getline(lines, line) && trim(line) != "}")
         {
-          string common_prefix = find_longest_common_prefix(matches);
-
-          if (common_prefix.length() > partial_cmd.length())
-          {
-            for (size_t i = 0; i < cursor_pos; i++)
-            {
-              cout << "\b \b" << flush;
-            }
-
-            input = common_prefix + input.substr(cursor_pos);
-            cursor_pos = common_prefix.length();
-            cout << input.substr(0, cursor_pos) << flush;
-
-            // FIX: Only add space if this is the **only match**
-            if (matches.size() == 1)
-            {
-              input += " ";
-              cursor_pos++;
-              cout << " " << flush;
-            }
-
-            tab_pressed_once = false;
-          }
-          else if (!tab_pressed_once)
-          {
-            cout << '\a' << flush;
-            tab_pressed_once = true;
-            previous_matches = matches;
-          }
-          else
-          {
-            cout << endl;
-            for (const auto &match : matches)
-            {
-              cout << match << "  ";
-            }
-            cout << endl
-                 << "$ " << input.substr(0, cursor_pos) << flush;
-            tab_pressed_once = false;
-          }
+          line = trim(line);
+          if (!line.empty() && line[0] != '#')
+            entry.lines.push_back(line);
         }
       }
-      else
-      {
-        tab_pressed_once = false;
-      }
+      entry.kind = RcEntry::FUNCTION;
+      rc.entries.push_back(entry);
+      continue;
     }
-    else if (c >= 32 && c < 127)
+
+    if (!parse_rc_definitions(line, rc.entries))
     {
-      input.insert(cursor_pos, 1, static_cast<char>(c));
-      cursor_pos++;
-      cout << c << flush;
-      tab_pressed_once = false;
+      entry.kind = RcEntry::COMMAND;
+      entry.lines.push_back(line);
+      rc.entries.push_back(entry);
     }
   }
+}
 
-  tcsetattr(STDIN_FILENO, TCSANOW, &old_term);
-#endif
+// Binary rc cache: a magic tag, the rc file's mtime and size it was built
+// from, then every entry in file order with its words already tokenized
+const char rc_cache_magic[8] = {'O', 'S', 'R', 'C', '0', '0', '0', '2'};
 
-  return input;
+void put_u64(string &out, uint64_t value)
+{
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
 }
 
-// Function to execute cd command
+void put_string(string &out, const string &value)
+{
+  uint32_t length = value.size();
+  out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+  out += value;
+}
 
-// Function to execute cd command
-#include <iostream>
-#include <unistd.h> // For chdir() and getcwd()
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <string.h>
-#include <errno.h>
-#include <unordered_set>
-#include <vector>
-#include <fstream>
-#include <sstream>
-#include <limits.h> // For PATH_MAX in POSIX systems
-#include <cstdlib>  // For getenv()
+void put_word(string &out, const Word &word)
+{
+  out += (char)word.quoted;
+  put_u64(out, word.parts.size());
+  for (const WordPart &part : word.parts)
+  {
+    out += (char)part.variable;
+    put_string(out, part.text);
+  }
+}
 
-using namespace std;
+string serialize_rc(const RcContents &rc, long long mtime, uint64_t size)
+{
+  string out(rc_cache_magic, sizeof(rc_cache_magic));
+  put_u64(out, mtime);
+  put_u64(out, size);
+  put_u64(out, rc.entries.size());
+  for (const RcEntry &entry : rc.entries)
+  {
+    out += (char)entry.kind;
+    put_string(out, entry.name);
+    put_word(out, entry.value);
+    put_u64(out, entry.lines.size());
+    for (const string &line : entry.lines)
+      put_string(out, line);
+  }
+  return out;
+}
 
-// Function to execute cd command
-void execute_cd(const std::string &path)
+// Bounds-checked reader over the mapped cache; any overrun marks it invalid
+struct CacheReader
 {
-  std::string final_path = path;
+  const char *data;
+  size_t size;
+  size_t offset = 0;
+  bool ok = true;
 
-  // If the path starts with '~', replace it with the HOME environment variable
-  if (path[0] == '~')
+  uint64_t u64()
   {
-    const char *home = getenv("HOME");
-    if (home)
+    uint64_t value = 0;
+    if (offset + sizeof(value) > size)
     {
-      final_path = home + std::string(path.substr(1)); // Replace ~ with HOME
+      ok = false;
+      return 0;
     }
-    else
+    memcpy(&value, data + offset, sizeof(value));
+    offset += sizeof(value);
+    return value;
+  }
+
+  string str()
+  {
+    uint32_t length = 0;
+    if (offset + sizeof(length) > size)
     {
-      std::cerr << "cd: HOME not set" << std::endl;
-      return;
+      ok = false;
+      return "";
+    }
+    memcpy(&length, data + offset, sizeof(length));
+    offset += sizeof(length);
+    if (offset + length > size)
+    {
+      ok = false;
+      return "";
     }
+    offset += length;
+    return string(data + offset - length, length);
   }
 
-#ifdef _WIN32
-  if (_chdir(final_path.c_str()) == -1)
-  { // For Windows
-    std::cerr << "cd: " << final_path << ": No such file or directory" << std::endl;
+  uint8_t byte()
+  {
+    if (offset + 1 > size)
+    {
+      ok = false;
+      return 0;
+    }
+    return data[offset++];
+  }
+
+  // Element counts are bounded by what could possibly fit in the file
+  uint64_t count()
+  {
+    uint64_t value = u64();
+    if (value > size)
+      ok = false;
+    return ok ? value : 0;
+  }
+
+  Word word()
+  {
+    Word word;
+    word.quoted = byte();
+    for (uint64_t n = count(); ok && n > 0; --n)
+    {
+      bool variable = byte();
+      word.parts.push_back({variable, str()});
+    }
+    return word;
+  }
+};
+
+bool deserialize_rc(const char *data, size_t size, long long mtime, uint64_t rc_size, RcContents &rc)
+{
+  if (size < sizeof(rc_cache_magic) || memcmp(data, rc_cache_magic, sizeof(rc_cache_magic)) != 0)
+    return false;
+
+  CacheReader reader = {data, size, sizeof(rc_cache_magic)};
+  if ((long long)reader.u64() != mtime || reader.u64() != rc_size || !reader.ok)
+    return false;
+
+  for (uint64_t n = reader.count(); reader.ok && n > 0; --n)
+  {
+    RcEntry entry;
+    uint8_t kind = reader.byte();
+    if (kind > RcEntry::COMMAND)
+      return false;
+    entry.kind = (RcEntry::Kind)kind;
+    entry.name = reader.str();
+    entry.value = reader.word();
+    for (uint64_t lines = reader.count(); reader.ok && lines > 0; --lines)
+      entry.lines.push_back(reader.str());
+    // A command is exactly one line; everything else defines a name
+    if (entry.kind == RcEntry::COMMAND ? entry.lines.size() != 1 : entry.name.empty())
+      return false;
+    rc.entries.push_back(entry);
   }
+  return reader.ok && reader.offset == size;
+}
+
+// Map the cache file and decode it if it still matches the rc file
+bool load_rc_cache(const string &path, long long mtime, uint64_t rc_size, RcContents &rc)
+{
+#ifdef _WIN32
+  ifstream file(path, ios::binary);
+  string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  return !data.empty() && deserialize_rc(data.data(), data.size(), mtime, rc_size, rc);
 #else
-  if (chdir(final_path.c_str()) == -1)
-  { // For Unix-like systems
-    std::cerr << "cd: " << final_path << ": No such file or directory" << std::endl;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+
+  struct stat buffer;
+  bool loaded = false;
+  if (fstat(fd, &buffer) == 0 && buffer.st_size > 0)
+  {
+    void *data = mmap(NULL, buffer.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED)
+    {
+      loaded = deserialize_rc(static_cast<const char *>(data), buffer.st_size, mtime, rc_size, rc);
+      munmap(data, buffer.st_size);
+    }
   }
+  close(fd);
+  return loaded;
 #endif
 }
 
-// Existing function for pwd
-void execute_builtin_pwd()
+// Write the cache next to the rc file; a rename keeps readers from ever
+// seeing a partial file
+void save_rc_cache(const string &path, const string &contents)
 {
-  char cwd[PATH_MAX]; // Use PATH_MAX for POSIX systems
-  if (getcwd(cwd, sizeof(cwd)) != NULL)
-  { // POSIX alternative to _getcwd()
-    cout << cwd << endl;
-  }
-  else
+  string temp = path + ".tmp";
   {
-    perror("pwd");
+    ofstream file(temp, ios::binary | ios::trunc);
+    file.write(contents.data(), contents.size());
+    if (!file)
+      return;
   }
+  if (rename(temp.c_str(), path.c_str()) != 0)
+    remove(temp.c_str());
 }
 
-int main()
+// Time spent in each startup phase, printed by --startup-profile
+struct StartupProfile
 {
-  cout << unitbuf;
-  cerr << unitbuf;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  chrono::steady_clock::time_point last = start;
+  vector<pair<string, double>> phases;
 
-  unordered_set<string> builtins = {"echo", "type", "exit", "pwd", "cd"};
-
-  while (true)
+  void mark(const string &phase)
   {
-    string input = get_input_with_completion();
-
-    if (input == "exit 0")
-    {
-      return 0;
-    }
+    auto now = chrono::steady_clock::now();
+    phases.push_back({phase, chrono::duration<double, milli>(now - last).count()});
+    last = now;
+  }
 
-    RedirectInfo stdout_info = {"", false};
-    RedirectInfo stderr_info = {"", false};
-    vector<string> args = parse_input(input, stdout_info, stderr_info);
+  void print() const
+  {
+    streamsize precision = cerr.precision();
+    cerr << fixed << setprecision(3);
+    for (const auto &phase : phases)
+      cerr << "startup: " << left << setw(14) << phase.first << right << setw(9) << phase.second << " ms" << endl;
+    cerr << "startup: " << left << setw(14) << "total" << right << setw(9)
+         << chrono::duration<double, milli>(last - start).count() << " ms" << endl;
+    cerr << defaultfloat << setprecision(precision);
+  }
+};
 
-    if (args.empty())
-      continue;
+// Load ~/.ownshellrc, from its binary cache when the cache is still valid
+void load_rc(StartupProfile &profile)
+{
+  const char *home = getenv("HOME");
+  if (!home)
+    return;
 
-    if (args[0] == "pwd")
-    {
-      execute_builtin_pwd();
-      continue;
-    }
+  string rc_path = string(home) + "/.ownshellrc";
+  string cache_path = rc_path + ".cache";
+  struct stat buffer;
+  bool exists = stat(rc_path.c_str(), &buffer) == 0;
+  profile.mark("locate rc");
+  if (!exists)
+    return;
 
-    if (args[0] == "echo")
-    {
-      ofstream out;
-      ofstream err;
-      streambuf *coutbuf = cout.rdbuf();
-      streambuf *cerrbuf = cerr.rdbuf();
+  long long mtime = modification_time(buffer);
+  uint64_t rc_size = buffer.st_size;
+  RcContents rc;
+  if (load_rc_cache(cache_path, mtime, rc_size, rc))
+  {
+    profile.mark("cache hit");
+  }
+  else
+  {
+    rc = RcContents();
+    ifstream file(rc_path);
+    string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    parse_rc(text, rc);
+    profile.mark("parse rc");
+    save_rc_cache(cache_path, serialize_rc(rc, mtime, rc_size));
+    profile.mark("write cache");
+  }
 
-      if (!stdout_info.filename.empty())
-      {
-        ios_base::openmode mode = ios::out;
-        if (stdout_info.append)
-          mode |= ios::app;
+  // Values may reference variables set earlier in the file (or HOME, which
+  // may differ between launches), so they are expanded only now
+  for (const RcEntry &entry : rc.entries)
+  {
+    if (entry.kind == RcEntry::ALIAS)
+      shell.aliases[entry.name] = expand_word(entry.value);
+    else if (entry.kind == RcEntry::FUNCTION)
+      shell.functions[entry.name] = entry.lines;
+    else if (entry.kind == RcEntry::EXPORT || (entry.kind == RcEntry::VARIABLE && getenv(entry.name.c_str())))
+      execute_export({"export", entry.name + "=" + expand_word(entry.value)});
+    else if (entry.kind == RcEntry::VARIABLE)
+      shell.variables[entry.name] = expand_word(entry.value);
+    else
+      execute_line(entry.lines[0]);
 
-        out.open(stdout_info.filename, mode);
-        cout.rdbuf(out.rdbuf());
-      }
+    if (shell.exit_requested)
+      break;
+  }
+  profile.mark("apply rc");
+}
 
-      if (!stderr_info.filename.empty())
-      {
-        ios_base::openmode mode = ios::out;
-        if (stderr_info.append)
-          mode |= ios::app;
+int main(int argc, char *argv[])
+{
+  StartupProfile profile;
+  cout << unitbuf;
+  cerr << unitbuf;
 
-        err.open(stderr_info.filename, mode);
-        cerr.rdbuf(err.rdbuf());
-      }
+  bool startup_profile = false;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (string(argv[i]) == "--startup-profile")
+      startup_profile = true;
+  }
 
-      for (size_t i = 1; i < args.size(); ++i)
-      {
-        cout << args[i] << (i + 1 < args.size() ? " " : "");
-      }
-      cout << endl;
+  load_rc(profile);
+  if (startup_profile)
+    profile.print();
+  if (shell.exit_requested)
+    return shell.exit_code;
 
-      if (!stdout_info.filename.empty())
-      {
-        cout.rdbuf(coutbuf);
-        out.close();
-      }
+  // Exit status and start time of the current command, shown in the prompt
+  int status = 0;
+  auto command_start = chrono::steady_clock::now();
+  bool ran_command = false;
 
-      if (!stderr_info.filename.empty())
-      {
-        cerr.rdbuf(cerrbuf);
-        err.close();
-      }
-      continue;
+  while (true)
+  {
+#ifndef _WIN32
+    if (ran_command)
+    {
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - command_start;
+      prompt.last_status = status;
+      prompt.last_duration = elapsed.count();
+      prompt.generation++;
     }
+#endif
 
-    if (args[0] == "type")
+    string input = get_input_with_completion();
+#ifndef _WIN32
+    if (terminal.eof && input.empty())
     {
-      if (args.size() < 2)
-      {
-        cout << "type: missing operand" << endl;
-        continue;
-      }
-      string cmd = args[1];
-      if (builtins.count(cmd))
-      {
-        cout << cmd << " is a shell builtin" << endl;
-      }
-      else
-      {
-        string path = find_in_path(cmd);
-        if (!path.empty())
-        {
-          cout << cmd << " is " << path << endl;
-        }
-        else
-        {
-          cout << cmd << ": not found" << endl;
-        }
-      }
-      continue;
+      return shell.last_status;
     }
+#endif
+    command_start = chrono::steady_clock::now();
+    ran_command = !input.empty();
 
-    // Handling 'cd' command
-    if (args[0] == "cd")
+    status = execute_line(input);
+    if (shell.exit_requested)
     {
-      if (args.size() < 2)
-      {
-        cerr << "cd: missing operand" << endl;
-      }
-      else
-      {
-        string path = args[1];
-        execute_cd(path); // Call the execute_cd function
-      }
-      continue;
+      return shell.exit_code;
     }
-
-    execute_external_command(args, stdout_info, stderr_info);
   }
 
   return 0;